@@ -32,6 +32,8 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <assert.h>
+#include <time.h>
+#include <sys/resource.h>
 
 // PATH_MAX
 #include <limits.h>
@@ -46,6 +48,7 @@
 #define MAX_SENT_LEN 20000
 #define MAX_WORD_PER_SENT 1000
 #define MAX_CODE_LENGTH 40
+#define SAVE_BUFFER (4 << 20) // stdio buffer of binary vector files
 
 const int vocab_hash_size = 30000000;  // Maximum 30 * 0.7 = 21M words in the vocabulary
 
@@ -88,6 +91,7 @@ long long layer1_size = 100;
 long long classes = 0;
 
 clock_t start;
+double program_start; // wall-clock start of the run
 char prefix[MAX_STRING];
 char output_prefix[MAX_STRING]; // output_prefix.lang: stores embeddings
 int eval_opt = 0; // evaluation option
@@ -1129,6 +1133,26 @@ void *TrainModelThread(void *id) {
   pthread_exit(NULL);
 }
 
+// Binary vector file body: per word "<word> ", layer1_size raw floats and "\n". Rows are written
+// whole; with m2 each row is m1 + m2, summed into row first.
+void WriteBinaryRows(FILE *fo, struct train_params *params, real *m1, real *m2, real *row) {
+  long long a, b;
+  char *word;
+  real *v;
+  for (a = 0; a < params->vocab_size; a++) {
+    word = params->vocab[a].word;
+    fwrite(word, 1, strlen(word), fo);
+    fputc(' ', fo);
+    v = &m1[a * layer1_size];
+    if (m2 != NULL) {
+      for (b = 0; b < layer1_size; b++) row[b] = v[b] + m2[a * layer1_size + b];
+      v = row;
+    }
+    fwrite(v, sizeof(real), layer1_size, fo);
+    fputc('\n', fo);
+  }
+}
+
 // opt 1: save avg vecs, 2: save out vecs
 void SaveVector(char* output_prefix, char* lang, struct train_params *params, int opt){
   long a, b;
@@ -1145,6 +1169,8 @@ void SaveVector(char* output_prefix, char* lang, struct train_params *params, in
   // Save the word vectors
   real *syn0 = params->syn0;
   FILE* fo = fopen(output_file, "wb");
+  char *buf = NULL, *buf_sum = NULL, *buf_out = NULL;
+  if (binary) setvbuf(fo, buf = (char *)malloc(SAVE_BUFFER), _IOFBF, SAVE_BUFFER);
   fprintf(fo, "%lld %lld\n", vocab_size, layer1_size);
 
   // Save sum out vecs or sum of in and out vecs
@@ -1156,6 +1182,7 @@ void SaveVector(char* output_prefix, char* lang, struct train_params *params, in
       char sum_vector_file[MAX_STRING];
       sprintf(sum_vector_file, "%s.sumvec.%s", output_prefix, lang);
       fo_sum = fopen(sum_vector_file, "wb");
+      if (binary) setvbuf(fo_sum, buf_sum = (char *)malloc(SAVE_BUFFER), _IOFBF, SAVE_BUFFER);
       fprintf(fo_sum, "%lld %lld\n", vocab_size, layer1_size);
     }
 
@@ -1163,41 +1190,35 @@ void SaveVector(char* output_prefix, char* lang, struct train_params *params, in
       char out_vector_file[MAX_STRING];
       sprintf(out_vector_file, "%s.outvec.%s", output_prefix, lang);
       fo_out = fopen(out_vector_file, "wb");
+      if (binary) setvbuf(fo_out, buf_out = (char *)malloc(SAVE_BUFFER), _IOFBF, SAVE_BUFFER);
       fprintf(fo_out, "%lld %lld\n", vocab_size, layer1_size);
     }
   }
 
-  for (a = 0; a < vocab_size; a++) {
+  if (binary) { // one file after the other, in whole rows
+    WriteBinaryRows(fo, params, syn0, NULL, NULL);
+    if (fo_sum != NULL) {
+      real *row = (real *)malloc(layer1_size * sizeof(real));
+      WriteBinaryRows(fo_sum, params, syn0, syn1neg, row);
+      free(row);
+    }
+    if (fo_out != NULL) WriteBinaryRows(fo_out, params, syn1neg, NULL, NULL);
+  } else for (a = 0; a < vocab_size; a++) {
     fprintf(fo, "%s ", vocab[a].word);
     if(hs==0) {
       if (save_avg_vecs) fprintf(fo_sum, "%s ", vocab[a].word);
       if (save_out_vecs) fprintf(fo_out, "%s ", vocab[a].word);
     }
 
-    if (binary) { // binary
-      for (b = 0; b < layer1_size; b++) {
-        fwrite(&syn0[a * layer1_size + b], sizeof(real), 1, fo);
+    for (b = 0; b < layer1_size; b++) {
+      fprintf(fo, "%lf ", syn0[a * layer1_size + b]);
 
-        if(hs==0) {
-          if (save_avg_vecs) {
-            sum = syn0[a * layer1_size + b] + syn1neg[a * layer1_size + b];
-            fwrite(&sum, sizeof(real), 1, fo_sum);
-          }
-          if (save_out_vecs) fwrite(&syn1neg[a * layer1_size + b], sizeof(real), 1, fo_out);
-        }
-
-      }
-    } else { // text
-      for (b = 0; b < layer1_size; b++) {
-        fprintf(fo, "%lf ", syn0[a * layer1_size + b]);
-
-        if(hs==0) {
-          if (save_avg_vecs) {
-            sum = syn0[a * layer1_size + b] + syn1neg[a * layer1_size + b];
-            fprintf(fo_sum, "%lf ", sum);
-          }
-          if (save_out_vecs) fprintf(fo_out, "%lf ", syn1neg[a * layer1_size + b]);
+      if(hs==0) {
+        if (save_avg_vecs) {
+          sum = syn0[a * layer1_size + b] + syn1neg[a * layer1_size + b];
+          fprintf(fo_sum, "%lf ", sum);
         }
+        if (save_out_vecs) fprintf(fo_out, "%lf ", syn1neg[a * layer1_size + b]);
       }
     }
     fprintf(fo, "\n");
@@ -1213,6 +1234,9 @@ void SaveVector(char* output_prefix, char* lang, struct train_params *params, in
     if (save_avg_vecs) fclose(fo_sum);
     if (save_out_vecs) fclose(fo_out);
   }
+  free(buf);
+  free(buf_sum);
+  free(buf_out);
 }
 
 void KMeans(char* output_file, struct train_params *params){
@@ -1302,8 +1326,22 @@ void MonoInit(struct train_params *params, long long train_words){
 #endif
 }
 
+double WallTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Peak resident set size of the process in kB
+long PeakRss() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
 void TrainModel() {
   long a;
+  double iter_start, train_seconds = 0;
 
   pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
   if (is_bi) printf("Starting training using src-file %s and tgt-file %s\n", src->train_file, tgt->train_file);
@@ -1325,14 +1363,17 @@ void TrainModel() {
   int save_opt = 1;
   char sum_vector_file[MAX_STRING];
   char sum_vector_prefix[MAX_STRING];
+  if (debug_mode > 0) printf("# startup total: %.3fs\n", WallTime() - program_start);
   for(cur_iter=start_iter; cur_iter<num_train_iters; cur_iter++){
     start = clock();
     src->word_count_actual = tgt->word_count_actual = 0;
 
     // Train Model
     fprintf(stderr, "\n## Start iter %d, alpha=%f ... ", cur_iter, alpha); execute("date"); fflush(stderr);
+    iter_start = WallTime();
     for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
     for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+    train_seconds += WallTime() - iter_start;
     fprintf(stderr, "\n# Done iter %d, alpha=%f, ", cur_iter, alpha); execute("date"); fflush(stderr);
     print_model_stat(src);
     if(is_bi) print_model_stat(tgt);
@@ -1386,6 +1427,7 @@ void TrainModel() {
       KMeans(class_file, tgt);
     }
   }
+  if (debug_mode > 0) printf("# training total: %.3fs\n# peak RSS: %ld kB\n", train_seconds, PeakRss());
 }
 
 int ArgPos(char *str, int argc, char **argv) {
@@ -1419,6 +1461,7 @@ struct train_params *InitTrainParams() {
 int main(int argc, char **argv) {
   // srand(21260063);
   int i;
+  program_start = WallTime();
   if (argc == 1) {
     printf("WORD VECTOR estimation toolkit v 0.1b\n\n");
     printf("Options:\n");
@@ -16,11 +16,107 @@
 #include <string.h>
 #include <math.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 const long long max_size = 2000;         // max length of strings
 const long long N = 40;                  // number of closest words that will be shown
 const long long max_w = 50;              // max length of vocabulary entries
 
+// Memory-mappable vector file written by multivec -binary 2; see WriteMappedVectors there
+#define EMBEDDING_MAGIC "MVEMB001"
+struct embedding_header {
+  char magic[8];
+  long long vocab_size, size;
+  long long matrix_offset, offsets_offset, strings_offset, hash_offset, hash_size, file_size;
+};
+
+// Quantized vector files written by multivec -quantize; see WriteQuantizedVectors there. The words
+// header comes first, so the word index is found the same way.
+#define QUANTIZED_MAGIC "MVQNT001"
+struct quantized_header {
+  struct embedding_header words;
+  long long kind, subvectors, centroids, scales_offset, codebooks_offset;
+};
+
+unsigned long long EmbeddingHash(const char *word) {
+  unsigned long long hash = 0;
+  for (; *word; word++) hash = hash * 257 + (unsigned char)*word;
+  return hash;
+}
+
+// Maps file_name if it is in the mappable or a quantized format; returns NULL otherwise
+char *MapEmbeddings(char *file_name) {
+  struct embedding_header *header;
+  struct stat st;
+  char *map;
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (long long)sizeof(struct embedding_header)) {
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+  map = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return NULL;
+  header = (struct embedding_header *)map;
+  if ((memcmp(header->magic, EMBEDDING_MAGIC, 8) && memcmp(header->magic, QUANTIZED_MAGIC, 8)) ||
+      header->file_size != st.st_size) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  return map;
+}
+
+// Decodes row a of a quantized file into vec
+void QuantizedRow(struct quantized_header *q, char *map, long long a, float *vec) {
+  long long b, m, size = q->words.size, dsub = size / (q->subvectors > 0 ? q->subvectors : 1);
+  signed char *codes = (signed char *)(map + q->words.matrix_offset);
+  float *scales = (float *)(map + q->scales_offset), *codebooks = (float *)(map + q->codebooks_offset);
+  unsigned char code;
+  if (q->kind == 1) {
+    for (b = 0; b < size; b++) vec[b] = scales[a] * codes[a * size + b];
+  } else for (m = 0; m < q->subvectors; m++) {
+    code = ((unsigned char *)codes)[a * q->subvectors + m];
+    for (b = 0; b < dsub; b++) vec[m * dsub + b] = codebooks[(m * q->centroids + code) * dsub + b];
+  }
+}
+
+// Cosine similarity of the unit vector vec with every row of a quantized file, computed on the codes:
+// int8 rows are a dot product with the codes times the row scale, PQ rows a sum of the entries a
+// table of vec against every centroid (asymmetric distance) gives their codes. norms holds the
+// norms of the decoded rows.
+void QuantizedScores(struct quantized_header *q, char *map, float *vec, float *norms, float *scores) {
+  long long a, b, j, m, size = q->words.size, words = q->words.vocab_size;
+  long long k = q->centroids, dsub = size / (q->subvectors > 0 ? q->subvectors : 1);
+  signed char *codes = (signed char *)(map + q->words.matrix_offset), *row;
+  unsigned char *pq_row;
+  float *scales = (float *)(map + q->scales_offset), *codebooks = (float *)(map + q->codebooks_offset), *table, dot;
+  if (q->kind == 1) {
+    for (a = 0; a < words; a++) {
+      row = &codes[a * size];
+      dot = 0;
+      for (b = 0; b < size; b++) dot += vec[b] * row[b];
+      scores[a] = norms[a] > 0 ? dot * scales[a] / norms[a] : 0;
+    }
+    return;
+  }
+  table = (float *)malloc(q->subvectors * k * sizeof(float));
+  for (m = 0; m < q->subvectors; m++) for (j = 0; j < k; j++) {
+    dot = 0;
+    for (b = 0; b < dsub; b++) dot += vec[m * dsub + b] * codebooks[(m * k + j) * dsub + b];
+    table[m * k + j] = dot;
+  }
+  for (a = 0; a < words; a++) {
+    pq_row = (unsigned char *)&codes[a * q->subvectors];
+    dot = 0;
+    for (m = 0; m < q->subvectors; m++) dot += table[m * k + pq_row[m]];
+    scores[a] = norms[a] > 0 ? dot / norms[a] : 0;
+  }
+  free(table);
+}
+
 int main(int argc, char **argv) {
   FILE *f;
   char st1[max_size];
@@ -30,34 +126,63 @@ int main(int argc, char **argv) {
   long long words, size, a, b, c, d, cn, bi[100];
   char ch;
   float *M;
-  char *vocab;
+  char *vocab = NULL, *map, *strings = NULL;
+  long long *offsets = NULL, h;
+  int *hash = NULL;
+  struct embedding_header *header = NULL;
+  struct quantized_header *quantized = NULL;
+  float *norms = NULL, *scores = NULL;
   if (argc < 2) {
-    printf("Usage: ./distance <FILE>\nwhere FILE contains word projections in the BINARY FORMAT\n");
+    printf("Usage: ./distance <FILE>\nwhere FILE contains word projections in the BINARY FORMAT, in the\n");
+    printf("memory-mappable format of multivec -binary 2, or quantized by multivec -quantize\n");
     return 0;
   }
   strcpy(file_name, argv[1]);
-  f = fopen(file_name, "rb");
-  if (f == NULL) {
-    printf("Input file not found\n");
-    return -1;
-  }
-  fscanf(f, "%lld", &words);
-  fscanf(f, "%lld", &size);
-  vocab = (char *)malloc((long long)words * max_w * sizeof(char));
-  M = (float *)malloc((long long)words * (long long)size * sizeof(float));
-  if (M == NULL) {
-    printf("Cannot allocate memory: %lld MB    %lld  %lld\n", (long long)words * size * sizeof(float) / 1048576, words, size);
-    return -1;
-  }
-  for (b = 0; b < words; b++) {
-    fscanf(f, "%s%c", &vocab[b * max_w], &ch);
-    for (a = 0; a < size; a++) fread(&M[a + b * size], sizeof(float), 1, f);
-    len = 0;
-    for (a = 0; a < size; a++) len += M[a + b * size] * M[a + b * size];
-    len = sqrt(len);
-    for (a = 0; a < size; a++) M[a + b * size] /= len;
+  map = MapEmbeddings(file_name);
+  if (map != NULL) { // used in place: words are looked up in the hash index, rows normalized on the fly
+    header = (struct embedding_header *)map;
+    words = header->vocab_size;
+    size = header->size;
+    M = (float *)(map + header->matrix_offset);
+    offsets = (long long *)(map + header->offsets_offset);
+    strings = map + header->strings_offset;
+    hash = (int *)(map + header->hash_offset);
+    if (!memcmp(header->magic, QUANTIZED_MAGIC, 8)) { // searched on the codes; M holds one decoded row
+      quantized = (struct quantized_header *)map;
+      M = (float *)malloc(size * sizeof(float));
+      norms = (float *)malloc(words * sizeof(float));
+      scores = (float *)malloc(words * sizeof(float));
+      for (b = 0; b < words; b++) {
+        QuantizedRow(quantized, map, b, M);
+        len = 0;
+        for (a = 0; a < size; a++) len += M[a] * M[a];
+        norms[b] = sqrt(len);
+      }
+    }
+  } else {
+    f = fopen(file_name, "rb");
+    if (f == NULL) {
+      printf("Input file not found\n");
+      return -1;
+    }
+    fscanf(f, "%lld", &words);
+    fscanf(f, "%lld", &size);
+    vocab = (char *)malloc((long long)words * max_w * sizeof(char));
+    M = (float *)malloc((long long)words * (long long)size * sizeof(float));
+    if (M == NULL) {
+      printf("Cannot allocate memory: %lld MB    %lld  %lld\n", (long long)words * size * sizeof(float) / 1048576, words, size);
+      return -1;
+    }
+    for (b = 0; b < words; b++) {
+      fscanf(f, "%s%c", &vocab[b * max_w], &ch);
+      for (a = 0; a < size; a++) fread(&M[a + b * size], sizeof(float), 1, f);
+      len = 0;
+      for (a = 0; a < size; a++) len += M[a + b * size] * M[a + b * size];
+      len = sqrt(len);
+      for (a = 0; a < size; a++) M[a + b * size] /= len;
+    }
+    fclose(f);
   }
-  fclose(f);
   while (1) {
     for (a = 0; a < N; a++) bestd[a] = 0;
     for (a = 0; a < N; a++) bestw[a][0] = 0;
@@ -89,8 +214,18 @@ int main(int argc, char **argv) {
     }
     cn++;
     for (a = 0; a < cn; a++) {
-      for (b = 0; b < words; b++) if (!strcmp(&vocab[b * max_w], st[a])) break;
-      if (b == words) b = -1;
+      if (map != NULL) {
+        b = -1;
+        for (h = EmbeddingHash(st[a]) % header->hash_size; hash[h] != -1; h = (h + 1) % header->hash_size) {
+          if (!strcmp(strings + offsets[hash[h]], st[a])) {
+            b = hash[h];
+            break;
+          }
+        }
+      } else {
+        for (b = 0; b < words; b++) if (!strcmp(&vocab[b * max_w], st[a])) break;
+        if (b == words) b = -1;
+      }
       bi[a] = b;
       printf("\nWord: %s  Position in vocabulary: %lld\n", st[a], bi[a]);
       if (b == -1) {
@@ -103,7 +238,18 @@ int main(int argc, char **argv) {
     for (a = 0; a < size; a++) vec[a] = 0;
     for (b = 0; b < cn; b++) {
       if (bi[b] == -1) continue;
-      for (a = 0; a < size; a++) vec[a] += M[a + bi[b] * size];
+      if (quantized != NULL) {
+        QuantizedRow(quantized, map, bi[b], M);
+        for (a = 0; a < size; a++) vec[a] += norms[bi[b]] > 0 ? M[a] / norms[bi[b]] : 0;
+        continue;
+      }
+      len = 1;
+      if (map != NULL) { // rows are not normalized
+        len = 0;
+        for (a = 0; a < size; a++) len += M[a + bi[b] * size] * M[a + bi[b] * size];
+        len = sqrt(len);
+      }
+      for (a = 0; a < size; a++) vec[a] += M[a + bi[b] * size] / len;
     }
     len = 0;
     for (a = 0; a < size; a++) len += vec[a] * vec[a];
@@ -111,12 +257,21 @@ int main(int argc, char **argv) {
     for (a = 0; a < size; a++) vec[a] /= len;
     for (a = 0; a < N; a++) bestd[a] = 0;
     for (a = 0; a < N; a++) bestw[a][0] = 0;
+    if (quantized != NULL) QuantizedScores(quantized, map, vec, norms, scores);
     for (c = 0; c < words; c++) {
       a = 0;
       for (b = 0; b < cn; b++) if (bi[b] == c) a = 1;
       if (a == 1) continue;
-      dist = 0;
-      for (a = 0; a < size; a++) dist += vec[a] * M[a + c * size];
+      if (quantized != NULL) dist = scores[c];
+      else {
+        dist = 0;
+        for (a = 0; a < size; a++) dist += vec[a] * M[a + c * size];
+        if (map != NULL) {
+          len = 0;
+          for (a = 0; a < size; a++) len += M[a + c * size] * M[a + c * size];
+          if (len > 0) dist /= sqrt(len);
+        }
+      }
       for (a = 0; a < N; a++) {
         if (dist > bestd[a]) {
           for (d = N - 1; d > a; d--) {
@@ -124,7 +279,7 @@ int main(int argc, char **argv) {
             strcpy(bestw[d], bestw[d - 1]);
           }
           bestd[a] = dist;
-          strcpy(bestw[a], &vocab[c * max_w]);
+          strcpy(bestw[a], map != NULL ? strings + offsets[c] : &vocab[c * max_w]);
           break;
         }
       }
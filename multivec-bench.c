@@ -0,0 +1,206 @@
+// Microbenchmarks for the multivec training kernels on a synthetic Zipf vocabulary:
+//   skip-gram pairs with negative sampling, skip-gram pairs with hierarchical softmax,
+//   and sentence reading with subsampling (ReadSentence over an in-memory id corpus).
+// Every kernel runs for vector sizes 40/100/300, negative sampling for 5 and 15 negatives, each on
+// 1, 2, 4, ... threads. Build and run with `make bench`.
+
+#define main multivec_main
+#include "multivec.c"
+#undef main
+
+long long bench_vocab_size = 100000;
+long long bench_pairs = 1000000; // per thread
+long long bench_words = 10000000; // per thread, for subsampling
+int bench_max_threads = 1;
+
+struct bench_job {
+  struct lang_params *lang;
+  long long *words; // skip pairs (in, out) or an id stream
+  long long n;
+  double seconds;
+};
+
+// Zipf-distributed word ids, drawn from the unigram table as training would see them
+long long *ZipfWords(struct lang_params *lang, long long n, unsigned long long seed) {
+  long long a, *words = (long long *)malloc(n * sizeof(long long));
+  for (a = 0; a < n; a++) {
+    seed = seed * (unsigned long long)25214903917 + 11;
+    words[a] = lang->table[(seed >> 16) % table_size];
+  }
+  return words;
+}
+
+void *SkipPairJob(void *arg) {
+  struct bench_job *job = (struct bench_job *)arg;
+  real *neu1e = (real *)calloc(layer1_size, sizeof(real));
+  unsigned long long next_random = (unsigned long long)job->words;
+  long long a;
+  double t = WallTime();
+  for (a = 0; a < job->n; a++) {
+    ProcessSkipPair(job->words[2 * a], job->words[2 * a + 1], &next_random, job->lang, job->lang, neu1e, 0.025);
+  }
+  job->seconds = WallTime() - t;
+  free(neu1e);
+  pthread_exit(NULL);
+}
+
+void *SubsampleJob(void *arg) {
+  struct bench_job *job = (struct bench_job *)arg;
+  struct block_corpus corpus;
+  struct word_source ws;
+  struct file_params train;
+  struct sentence_pair *sp = (struct sentence_pair *)malloc(sizeof(struct sentence_pair));
+  unsigned long long next_random = 1;
+  long long a, words = 0, read = 0;
+  double t;
+
+  corpus.size = corpus.max_size = job->n;
+  corpus.state = CORPUS_MEMORY;
+  corpus.ids = (int *)malloc(job->n * sizeof(int));
+  for (a = 0; a < job->n; a++) corpus.ids[a] = a % 25 == 24 ? 0 : job->words[a]; // 24-word sentences
+  train.lang = job->lang;
+  train.train_words = job->n;
+  ws.fi = NULL;
+  ws.corpus = &corpus;
+  ws.pos = 0;
+  ws.eof = 0;
+  t = WallTime();
+  while (!ws.eof) {
+    ReadSentence(&ws, &train, sp->src_sen, sp->src_id_map, &sp->src_length, &sp->src_orig_length, &words, &read, &next_random);
+  }
+  job->seconds = WallTime() - t;
+  free(corpus.ids);
+  free(sp);
+  pthread_exit(NULL);
+}
+
+// Runs kernel on num_threads threads; returns the wall-clock time of the slowest one
+double RunJobs(void *(*kernel)(void *), struct lang_params *lang, long long n, int per_item, int num_threads) {
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  struct bench_job *jobs = (struct bench_job *)malloc(num_threads * sizeof(struct bench_job));
+  double seconds = 0;
+  int t;
+  for (t = 0; t < num_threads; t++) {
+    jobs[t].lang = lang;
+    jobs[t].n = n;
+    jobs[t].words = ZipfWords(lang, n * per_item, t + 1);
+  }
+  for (t = 0; t < num_threads; t++) pthread_create(&pt[t], NULL, kernel, &jobs[t]);
+  for (t = 0; t < num_threads; t++) pthread_join(pt[t], NULL);
+  for (t = 0; t < num_threads; t++) {
+    if (jobs[t].seconds > seconds) seconds = jobs[t].seconds;
+    free(jobs[t].words);
+  }
+  free(jobs);
+  free(pt);
+  return seconds;
+}
+
+struct lang_params *SyntheticLanguage() {
+  struct lang_params *lang = InitLangParams("bench");
+  char word[MAX_STRING];
+  long long a;
+  for (a = 0; a < vocab_hash_size; a++) lang->vocab_hash[a] = -1;
+  for (a = 0; a < bench_vocab_size; a++) {
+    sprintf(word, "w%lld", a);
+    AddWordToVocab(word, lang);
+    lang->vocab_cn[a] = 1000000000LL / (a + 1);
+  }
+  CreateBinaryTree(lang);
+  InitUnigramTable(lang);
+  return lang;
+}
+
+void InitVectors(struct lang_params *lang) {
+  unsigned long long next_random = 1;
+  long long a, n = lang->vocab_size * layer1_size;
+  free(lang->syn0); free(lang->syn1); free(lang->syn1neg);
+  posix_memalign((void **)&lang->syn0, 128, n * sizeof(real));
+  posix_memalign((void **)&lang->syn1, 128, n * sizeof(real));
+  posix_memalign((void **)&lang->syn1neg, 128, n * sizeof(real));
+  for (a = 0; a < n; a++) {
+    next_random = next_random * (unsigned long long)25214903917 + 11;
+    lang->syn0[a] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / layer1_size;
+    lang->syn1[a] = lang->syn1neg[a] = 0;
+  }
+}
+
+int ArgPos(char *str, int argc, char **argv);
+
+int main(int argc, char **argv) {
+  int sizes[] = {40, 100, 300}, negatives[] = {5, 15};
+  int s, k, t, i;
+  long long a, code_total = 0, total_cn = 0;
+  double seconds, base, bytes, avg_codelen;
+  struct lang_params *lang;
+
+  if ((i = ArgPos((char *)"-h", argc, argv)) > 0 || (i = ArgPos((char *)"-help", argc, argv)) > 0) {
+    printf("Options:\n");
+    printf("\t-vocab <int>\n\t\tSynthetic vocabulary size; default is 100000\n");
+    printf("\t-pairs <int>\n\t\tSkip-gram pairs per thread; default is 1000000\n");
+    printf("\t-words <int>\n\t\tWords read per thread in the subsampling benchmark; default is 10000000\n");
+    printf("\t-threads <int>\n\t\tLargest thread count; runs 1, 2, 4, ... up to it; default is the number of CPUs\n");
+    return 0;
+  }
+  bench_max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if ((i = ArgPos((char *)"-vocab", argc, argv)) > 0) bench_vocab_size = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-pairs", argc, argv)) > 0) bench_pairs = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-words", argc, argv)) > 0) bench_words = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) bench_max_threads = atoi(argv[i + 1]);
+  if (bench_max_threads < 1) bench_max_threads = 1;
+  debug_mode = 0;
+
+  expTable = (real *)malloc((EXP_TABLE_SIZE + 1) * sizeof(real));
+  for (i = 0; i < EXP_TABLE_SIZE; i++) {
+    expTable[i] = exp((i / (real)EXP_TABLE_SIZE * 2 - 1) * MAX_EXP);
+    expTable[i] = expTable[i] / (expTable[i] + 1);
+  }
+  lang = SyntheticLanguage();
+  for (a = 0; a < lang->vocab_size; a++) {
+    code_total += lang->vocab_codelen[a] * lang->vocab_cn[a];
+    total_cn += lang->vocab_cn[a];
+  }
+  avg_codelen = code_total / (double)total_cn;
+  printf("# vocab %lld words, average Huffman code length %.2f\n", lang->vocab_size, avg_codelen);
+  // GB/s counts every syn0 / syn1 / syn1neg row touched by a pair as read and written once, and the
+  // 4-byte id of every word read for subsampling
+  printf("%-12s %5s %4s %7s %10s %10s %8s %8s\n", "kernel", "size", "neg", "threads", "ns/item", "Mitems/s", "GB/s", "speedup");
+
+  for (s = 0; s < 3; s++) {
+    layer1_size = sizes[s];
+    InitVectors(lang);
+
+    hs = 0;
+    for (k = 0; k < 2; k++) {
+      negative = negatives[k];
+      for (t = 1, base = 0; t <= bench_max_threads; t *= 2) {
+        seconds = RunJobs(SkipPairJob, lang, bench_pairs, 2, t);
+        bytes = 2.0 * (negative + 2) * layer1_size * sizeof(real) * bench_pairs * t;
+        if (t == 1) base = bench_pairs / seconds;
+        printf("%-12s %5lld %4d %7d %10.1f %10.2f %8.2f %8.2f\n", "skip-neg", layer1_size, negative, t,
+               seconds * 1e9 / bench_pairs, bench_pairs * t / seconds / 1e6, bytes / seconds / 1e9, bench_pairs * t / seconds / base);
+      }
+    }
+
+    hs = 1;
+    negative = 0;
+    for (t = 1, base = 0; t <= bench_max_threads; t *= 2) {
+      seconds = RunJobs(SkipPairJob, lang, bench_pairs, 2, t);
+      bytes = 2.0 * (avg_codelen + 1) * layer1_size * sizeof(real) * bench_pairs * t;
+      if (t == 1) base = bench_pairs / seconds;
+      printf("%-12s %5lld %4s %7d %10.1f %10.2f %8.2f %8.2f\n", "skip-hs", layer1_size, "-", t,
+             seconds * 1e9 / bench_pairs, bench_pairs * t / seconds / 1e6, bytes / seconds / 1e9, bench_pairs * t / seconds / base);
+    }
+  }
+
+  hs = 0;
+  negative = 5;
+  for (t = 1, base = 0; t <= bench_max_threads; t *= 2) {
+    seconds = RunJobs(SubsampleJob, lang, bench_words, 1, t);
+    bytes = (double)sizeof(int) * bench_words * t;
+    if (t == 1) base = bench_words / seconds;
+    printf("%-12s %5s %4s %7d %10.1f %10.2f %8.2f %8.2f\n", "subsample", "-", "-", t,
+           seconds * 1e9 / bench_words, bench_words * t / seconds / 1e6, bytes / seconds / 1e9, bench_words * t / seconds / base);
+  }
+  return 0;
+}
@@ -7,6 +7,17 @@
 #include <unistd.h>
 #include <assert.h>
 #include <libgen.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <time.h>
+#include <signal.h>
 // PATH_MAX
 #include <limits.h>
 #ifdef PATH_MAX
@@ -21,22 +32,22 @@
 #define MAX_SENT_LEN 20000
 #define MAX_WORD_PER_SENT 1000
 #define MAX_CODE_LENGTH 40
+#define MAX_ALIGN_LINKS 65535
+#define ALIGN_MAGIC "MVALIGN1"
+#define PREFETCH_BATCH 32
+#define PROGRESS_CHUNK 10000
+#define SAVE_BUFFER (4 << 20) // stdio buffer of vector files
+#define SAVE_CHUNK_ROWS 1024 // rows of a text vector file formatted at a time by one thread
 
 const int vocab_hash_size = 30000000;  // Maximum 30 * 0.7 = 21M words in the vocabulary
 
 typedef float real;                    // Precision of float numbers
 
-struct vocab_word {
-  long long cn;
-  int *point;
-  char *word, *code, codelen;
-};
-
 // training structure, useful when training embeddings for multiple languages
 struct pair_params **all_pairs; //malloc'd in main
 struct lang_params **all_langs; //malloc'd in main
 char **language_indices;
-struct pair_params *pair; //current pair being used by TrainModelThread
+struct pair_params *pair; //current pair being set up by TrainAllLanguagePairs
 
 //struct for all info related to a language: vocab, output file, vectors
 struct lang_params {
@@ -44,10 +55,30 @@ struct lang_params {
   char output_file[MAX_STRING];
   char vocab_file[MAX_STRING];
   char config_file[MAX_STRING];
-  struct vocab_word *vocab;
-  struct vocab_word *backup_vocab;
   int *vocab_hash;
 
+  // vocabulary, stored as parallel arrays indexed by word id.
+  // vocab_cn is the only one touched per token during training; the words themselves
+  // live back to back in a single string arena (vocab_strings) and are found by offset.
+  long long *vocab_cn;
+  long long *vocab_word; // offset of each word in vocab_strings
+  char *vocab_strings;
+  long long vocab_strings_size, vocab_strings_max_size;
+  long long *backup_vocab_word;
+  char *backup_vocab_strings;
+
+  // hierarchical softmax only (NULL when hs == 0): Huffman code length of each word, and
+  // the offset of its code/point path in the flat vocab_code/vocab_point arrays
+  char *vocab_codelen;
+  long long *vocab_path;
+  char *vocab_code;
+  int *vocab_point;
+
+  // minimal perfect hash over the final vocab (-perfect-hash 1); replaces vocab_hash once built
+  long long mph_num_buckets;
+  unsigned int *mph_pilot;
+  struct mph_slot *mph_slots;
+
   // syn0: input embeddings (exist for both hierarchical softmax and negative sampling)
   // syn1: output embeddings (hierarchical softmax)
   // syn1neg: output embeddings (negative sampling)
@@ -56,6 +87,7 @@ struct lang_params {
   real *syn0, *syn1, *syn1neg;
   int *table;
   int full_vocab; //set to 1 once all training files have been read and vocab is complete
+  char *frozen; // rows of syn0 that training leaves alone (-freeze), or NULL
 
   long long unk_id; // index of the <unk> word
 
@@ -75,9 +107,19 @@ struct file_params {
   long long num_lines; //number of lines
   long long *line_blocks; //offsets in each file for each thread (indexed by thread #)
   long long train_words; //number of tokens in training file
-  long long word_count_actual; //current progress in training file
+  struct block_corpus *blocks; //word ids of each thread block, kept in memory with -corpus-memory
 };
 
+// Word ids of one thread block of a training file, recorded while the first iteration reads it and
+// replayed from memory by later ones. Ids are stored as ReadWordIndex returns them, so -1 is an
+// unknown word and 0 (</s>) ends a sentence.
+struct block_corpus {
+  int *ids;
+  long long size, max_size;
+  int state;
+};
+enum { CORPUS_DISK, CORPUS_RECORD, CORPUS_MEMORY };
+
 //struct for grouping specific language pairs, alignment info
 struct pair_params {
   struct file_params *src;
@@ -87,6 +129,7 @@ struct pair_params {
   char align_file[MAX_STRING];
   long long align_num_lines;
   long long *align_line_blocks;
+  int align_binary; // align_file is in the -convert-align format
 };
 
 //looping over languages
@@ -95,11 +138,36 @@ int ll1;
 //looping over language pairs
 int lp1;
 
+// slot of the minimal perfect hash: the full 64-bit hash of the word stored there is kept as a
+// fingerprint, so out-of-vocabulary words are rejected with a single compare
+struct mph_slot {
+  unsigned long long fingerprint;
+  long long word;
+};
+
 int binary = 0, debug_mode = 2, min_count = 5, num_threads = 1, min_reduce = 1;
+long long vocab_budget = 0; // max distinct words tracked while learning the vocab (0 = exact counts)
+int perfect_hash = 0; // look words up through a minimal perfect hash once the vocab is final
+long long line_index_stride = 256; // lines between two offsets stored in a .lidx sidecar file
+int init_cache = 0; // reuse vocab, Huffman tree, unigram table and initial syn0 from a per-language cache
+unsigned long long init_seed = 1; // seed of the random syn0 initialization
+int reader_threads = 0; // threads parsing sentence pairs for the training threads (0 = each training thread parses its own)
+long long corpus_memory = 0; // bytes available to keep training files in memory as word ids (0 = always read from disk)
+long long corpus_memory_used = 0;
+int stream_mode = 0; // some training file is a pipe: a single dispatcher reads all files and feeds every training thread
+long long expected_words = 0; // words expected in each piped training file, for progress and alpha (0 = from the vocab)
 long long layer1_size = 100;
 long long classes = 0;
 
-clock_t start;
+double start; // wall-clock start of the current iteration
+double program_start; // wall-clock start of the run
+char stats_file_name[MAX_STRING]; // JSON lines with phase and thread timings (-stats-file)
+FILE *stats_file = NULL;
+int save_precision = 6; // digits after the decimal point in text vector files (-save-precision)
+int save_merged = 0; // also write all languages to <output> (-save-merged)
+int save_threads = 0; // threads writing a -save-async save while training goes on (-save-threads, 0 = num_threads / 4)
+int perf_counters = 0; // sample hardware counters around sentence processing (-perf-counters)
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
 char prefix[MAX_STRING];
 char output_prefix[MAX_STRING]; // output_prefix.lang: stores embeddings
 int eval_opt = 0; // evaluation option
@@ -116,6 +184,10 @@ const int table_size = 1e8;
 // training epoch & learning rate
 int num_train_iters = 1, cur_iter = 0, start_iter = 0; // run multiple iterations
 real alpha = 0.025, starting_alpha;
+// words trained on in the current iteration, over all pairs and threads; threads add to it in chunks
+// of PROGRESS_CHUNK words and derive their alpha from it
+long long word_count_actual = 0;
+long long train_words_total = 0; // src and tgt words of all pairs, i.e. the length of one iteration
 
 // monolingual embeddings
 real sample = 1e-4;
@@ -124,8 +196,7 @@ real sample = 1e-4;
 int align_debug = 0;
 int align_opt = 0;
 
-real bi_weight = 4.0; // how much we weight the crosslingual predictions. 4 by default, according to Luong et al. 2015
-real bi_alpha; // learning rate for crosslingual predictions, set to alpha * bi_weight;
+real bi_weight = 4.0; // how much we weight the crosslingual predictions (learning rate alpha * bi_weight). 4 by default, according to Luong et al. 2015
 /** End For bilingual embeddings **/
 
 
@@ -141,6 +212,11 @@ real samples[MAX_LANGS];
 
 int global_debug_flag = 0;
 
+// Returns the string of word a from the language's string arena
+char *GetVocabWord(const struct lang_params *params, long long a) {
+  return params->vocab_strings + params->vocab_word[a];
+}
+
 /** Debugging code **/
 // print stat of a real array
 void print_real_array(real* a_syn, long long num_elements, char* name){
@@ -166,17 +242,17 @@ void print_model_stat(struct lang_params *params){
 }
 
 // print a sent
-void print_sent(long long* sent, int sent_len, struct vocab_word* vocab, char* name){
+void print_sent(long long* sent, int sent_len, struct lang_params *params, char* name){
   int i;
   char buf[MAX_SENT_LEN];
   char token[MAX_STRING];
   sprintf(buf, "%s ", name);
   for(i=0; i<sent_len; i++) {
     if(i<(sent_len-1)) {
-      sprintf(token, "%s ", vocab[sent[i]].word);
+      sprintf(token, "%s ", GetVocabWord(params, sent[i]));
       strcat(buf, token);
     } else {
-      sprintf(token, "%s\n", vocab[sent[i]].word);
+      sprintf(token, "%s\n", GetVocabWord(params, sent[i]));
       strcat(buf, token);
     }
   }
@@ -184,16 +260,189 @@ void print_sent(long long* sent, int sent_len, struct vocab_word* vocab, char* n
   fflush(stdout);
 }
 
+/** Timing **/
+// Monotonic wall-clock time in seconds
+double WallTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Writes str as a JSON string literal
+void WriteJsonString(FILE *f, const char *str) {
+  fputc('"', f);
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\') fputc('\\', f);
+    if ((unsigned char)*str >= 32) fputc(*str, f);
+  }
+  fputc('"', f);
+}
+
+// Reports the wall-clock time of a setup or output phase on stdout and in the stats file
+void LogPhase(const char *phase, const char *name, double phase_start) {
+  double seconds = WallTime() - phase_start;
+  if (debug_mode > 0) printf("# %s %s: %.3fs\n", phase, name, seconds);
+  if (stats_file == NULL) return;
+  pthread_mutex_lock(&stats_lock);
+  fprintf(stats_file, "{\"event\": \"phase\", \"phase\": \"%s\", \"name\": ", phase);
+  WriteJsonString(stats_file, name);
+  fprintf(stats_file, ", \"seconds\": %.6f}\n", seconds);
+  fflush(stats_file);
+  pthread_mutex_unlock(&stats_lock);
+}
+
+// Peak resident set size of the process in kB
+long PeakRss() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+void LogRun(double train_seconds) {
+  if (debug_mode > 0) printf("# training total: %.3fs\n# peak RSS: %ld kB\n", train_seconds, PeakRss());
+  if (stats_file == NULL) return;
+  fprintf(stats_file, "{\"event\": \"run\", \"train_seconds\": %.6f, \"peak_rss_kb\": %ld}\n", train_seconds, PeakRss());
+  fflush(stats_file);
+}
+
+// Per-thread counters of one iteration. input_seconds is spent getting sentence pairs: parsing them,
+// or waiting for a reader thread; idle_seconds is the wait for the slowest thread at the end.
+struct thread_stats {
+  double seconds, input_seconds, end;
+  long long words, sentence_pairs;
+};
+struct thread_stats *thread_stats;
+
+// Hardware counters of the training threads (-perf-counters). Each thread opens them as one group,
+// reads the group after every sentence pair and adds the difference to the pair's language pair.
+// Counters the kernel or the CPU does not provide are left out of the reports.
+#define NUM_PERF_EVENTS 4
+#define PERF_SLOTS (NUM_PERF_EVENTS + 1) // the counters, then the words trained
+const char *perf_event_names[NUM_PERF_EVENTS] = {"cycles", "instructions", "llc_misses", "dtlb_misses"};
+int perf_available[NUM_PERF_EVENTS]; // opened by at least one thread
+long long *perf_counts; // [thread][pair][slot], for the current iteration
+int perf_warned = 0;
+
+struct perf_group {
+  int leader;
+  int fd[NUM_PERF_EVENTS]; // -1 if unavailable
+  int index[NUM_PERF_EVENTS]; // position in a group read
+  int num_open;
+};
+
+// Opens the counters for the calling thread; returns 0 if none could be opened
+int PerfOpen(struct perf_group *g) {
+  struct perf_event_attr attr;
+  int e;
+  g->leader = -1;
+  g->num_open = 0;
+  for (e = 0; e < NUM_PERF_EVENTS; e++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.disabled = g->leader == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    if (e < 2) {
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = e == 0 ? PERF_COUNT_HW_CPU_CYCLES : PERF_COUNT_HW_INSTRUCTIONS;
+    } else {
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = (e == 2 ? PERF_COUNT_HW_CACHE_LL : PERF_COUNT_HW_CACHE_DTLB) |
+                    (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    }
+    // this thread, any CPU
+    g->fd[e] = syscall(__NR_perf_event_open, &attr, 0, -1, g->leader, 0);
+    if (g->fd[e] < 0) {
+      if (e == 0 && !perf_warned) printf("! -perf-counters: perf_event_open: %s\n", strerror(errno));
+      if (e == 0) perf_warned = 1;
+      continue;
+    }
+    if (g->leader == -1) g->leader = g->fd[e];
+    g->index[e] = g->num_open++;
+    perf_available[e] = 1;
+  }
+  if (g->leader == -1) return 0;
+  ioctl(g->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(g->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return 1;
+}
+
+void PerfClose(struct perf_group *g) {
+  int e;
+  for (e = 0; e < NUM_PERF_EVENTS; e++) if (g->fd[e] >= 0) close(g->fd[e]);
+}
+
+void PerfRead(struct perf_group *g, long long *values) {
+  unsigned long long buf[1 + NUM_PERF_EVENTS];
+  int e;
+  if (read(g->leader, buf, sizeof(buf)) < (ssize_t)((1 + g->num_open) * sizeof(unsigned long long))) return;
+  for (e = 0; e < NUM_PERF_EVENTS; e++) values[e] = g->fd[e] >= 0 ? buf[1 + g->index[e]] : 0;
+}
+
+// Reports the counters of the iteration per language pair, and per thread in the stats file
+void LogPerfCounters(int iter) {
+  int p, t, e;
+  long long sum[PERF_SLOTS], *counts;
+  struct pair_params *pair;
+  for (e = 0; e < NUM_PERF_EVENTS && !perf_available[e]; e++);
+  if (e == NUM_PERF_EVENTS) {
+    if (iter == start_iter) printf("! -perf-counters: no hardware counters available, nothing to report\n");
+    return;
+  }
+  for (p = 0; p < num_pairs; p++) {
+    pair = all_pairs[p];
+    memset(sum, 0, sizeof(sum));
+    for (t = 0; t < num_threads; t++) {
+      counts = &perf_counts[((long long)t * num_pairs + p) * PERF_SLOTS];
+      for (e = 0; e < PERF_SLOTS; e++) sum[e] += counts[e];
+      if (stats_file == NULL) continue;
+      fprintf(stats_file, "{\"event\": \"perf\", \"iter\": %d, \"pair\": \"%s-%s\", \"thread\": %d, \"words\": %lld",
+              iter, pair->src->lang->lang_name, pair->tgt->lang->lang_name, t, counts[NUM_PERF_EVENTS]);
+      for (e = 0; e < NUM_PERF_EVENTS; e++) if (perf_available[e]) fprintf(stats_file, ", \"%s\": %lld", perf_event_names[e], counts[e]);
+      fprintf(stats_file, "}\n");
+    }
+    printf("# perf iter %d %s-%s: %lld words", iter, pair->src->lang->lang_name, pair->tgt->lang->lang_name, sum[NUM_PERF_EVENTS]);
+    for (e = 0; e < NUM_PERF_EVENTS; e++) if (perf_available[e]) {
+      printf(", %s %.1f/word", perf_event_names[e], sum[e] / (double)(sum[NUM_PERF_EVENTS] + 1));
+    }
+    if (perf_available[0] && perf_available[1]) printf(", IPC %.2f", sum[1] / (double)(sum[0] + 1));
+    printf("\n");
+  }
+  if (stats_file != NULL) fflush(stats_file);
+  memset(perf_counts, 0, (long long)num_threads * num_pairs * PERF_SLOTS * sizeof(long long));
+}
+
+void LogIteration(int iter, double iter_start, double iter_end) {
+  int t;
+  double seconds = iter_end - iter_start;
+  struct thread_stats *ts;
+  if (debug_mode > 0) printf("# iter %d: %.3fs, %.2fk words/sec\n", iter, seconds, word_count_actual / seconds / 1000);
+  if (stats_file == NULL) return;
+  for (t = 0; t < num_threads; t++) {
+    ts = &thread_stats[t];
+    fprintf(stats_file, "{\"event\": \"thread\", \"iter\": %d, \"thread\": %d, \"seconds\": %.6f, \"words\": %lld, "
+            "\"sentence_pairs\": %lld, \"words_per_sec\": %.1f, \"sentences_per_sec\": %.1f, \"input_seconds\": %.6f, "
+            "\"idle_seconds\": %.6f}\n", iter, t, ts->seconds, ts->words, ts->sentence_pairs, ts->words / (ts->seconds + 1e-9),
+            ts->sentence_pairs / (ts->seconds + 1e-9), ts->input_seconds, iter_end - ts->end);
+  }
+  fprintf(stats_file, "{\"event\": \"iter\", \"iter\": %d, \"seconds\": %.6f, \"words\": %lld, \"words_per_sec\": %.1f, "
+          "\"alpha\": %f}\n", iter, seconds, word_count_actual, word_count_actual / seconds, alpha);
+  fflush(stats_file);
+}
 
 void BackupVocab(struct lang_params * params) {
   int a;
   printf("Vocab size is %lld\n", params->vocab_size);
-  params->backup_vocab = (struct vocab_word *)calloc(params->vocab_max_size, sizeof(struct vocab_word));
+  params->backup_vocab_word = (long long *)malloc(params->vocab_size * sizeof(long long));
+  params->backup_vocab_strings = (char *)malloc(params->vocab_strings_size);
+  memcpy(params->backup_vocab_word, params->vocab_word, params->vocab_size * sizeof(long long));
+  memcpy(params->backup_vocab_strings, params->vocab_strings, params->vocab_strings_size);
   for (a = 0; a < params->vocab_size; a++) {
-    memcpy(&params->backup_vocab[a], &params->vocab[a], sizeof(struct vocab_word));
-    printf("Vocab word %s == %s        \r", params->vocab[a].word, params->backup_vocab[a].word);
-    if (strcmp(params->vocab[a].word, params->backup_vocab[a].word)) {
-      printf("Words %s and %s not equal at position %d\n", params->vocab[a].word, params->backup_vocab[a].word, a);
+    char *backup_word = params->backup_vocab_strings + params->backup_vocab_word[a];
+    printf("Vocab word %s == %s        \r", GetVocabWord(params, a), backup_word);
+    if (strcmp(GetVocabWord(params, a), backup_word)) {
+      printf("Words %s and %s not equal at position %d\n", GetVocabWord(params, a), backup_word, a);
       return;
     }
   }
@@ -204,8 +453,9 @@ void CompareBackupVocab(struct lang_params * params) {
   int a;
   printf("Vocab size is %lld\n", params->vocab_size);
   for (a = 0; a < params->vocab_size; a++) {
-    if (strcmp(params->vocab[a].word, params->backup_vocab[a].word)) {
-      printf("Words %s and %s not equal at position %d\n", params->vocab[a].word, params->backup_vocab[a].word, a);
+    char *backup_word = params->backup_vocab_strings + params->backup_vocab_word[a];
+    if (strcmp(GetVocabWord(params, a), backup_word)) {
+      printf("Words %s and %s not equal at position %d\n", GetVocabWord(params, a), backup_word, a);
       return;
     }
   }
@@ -217,11 +467,12 @@ void CheckVocab(struct lang_params * params) {
   printf("Vocab size is %lld\n", params->vocab_size);
   for (a = 0; a < params->vocab_size; a++) {
     printf("Vocab word #%d, ", a);
-    printf("word is %s, ", params->vocab[a].word);
-    printf("count (cn) is %lld, ", params->vocab[a].cn);
-    printf("point (relevant to sorting) is %d, ", *(params->vocab[a].point));
-    printf("code is %s, ", params->vocab[a].code);
-    printf("codelen is %d. ", params->vocab[a].codelen);
+    printf("word is %s, ", GetVocabWord(params, a));
+    printf("count (cn) is %lld, ", params->vocab_cn[a]);
+    if (hs) {
+      printf("point (relevant to sorting) is %d, ", params->vocab_point[params->vocab_path[a]]);
+      printf("codelen is %d. ", params->vocab_codelen[a]);
+    }
     printf("\r");
     fflush(stdout);
     printf("\r");
@@ -292,16 +543,16 @@ void InitUnigramTable(struct lang_params *params) {
   long long train_words_pow = 0;
   real d1, power = 0.75;
   long long vocab_size = params->vocab_size;
-  struct vocab_word *vocab = params->vocab;
+  long long *vocab_cn = params->vocab_cn;
   params->table = (int *)malloc(table_size * sizeof(int));
-  for (a = 0; a < vocab_size; a++) train_words_pow += pow(vocab[a].cn, power);
+  for (a = 0; a < vocab_size; a++) train_words_pow += pow(vocab_cn[a], power);
   i = 0;
-  d1 = pow(vocab[i].cn, power) / (real)train_words_pow;
+  d1 = pow(vocab_cn[i], power) / (real)train_words_pow;
   for (a = 0; a < table_size; a++) {
     params->table[a] = i;
     if (a / (real)table_size > d1) {
       i++;
-      d1 += pow(vocab[i].cn, power) / (real)train_words_pow;
+      d1 += pow(vocab_cn[i], power) / (real)train_words_pow;
     }
     if (i >= vocab_size) i = vocab_size - 1;
   }
@@ -342,17 +593,48 @@ int GetWordHash(char *word) {
 }
 
 
+// 64-bit hash used by the minimal perfect hash (FNV-1a followed by the splitmix64 finalizer)
+unsigned long long Mix64(unsigned long long x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+unsigned long long GetWordHash64(char *word) {
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  for (; *word; word++) hash = (hash ^ (unsigned char)*word) * 0x100000001b3ULL;
+  return Mix64(hash);
+}
+
+// Slot of a word with 64-bit hash h, given the pilot of its bucket
+long long GetPerfectHashSlot(unsigned long long h, unsigned int pilot, long long num_slots) {
+  return Mix64(h ^ ((pilot + 1ULL) * 0x9e3779b97f4a7c15ULL)) % num_slots;
+}
+
+// Returns position of a word in the frozen vocabulary, or -1: one hash, one slot fetch, one compare
+int SearchVocabPerfect(char *word, const struct lang_params *params) {
+  unsigned long long h = GetWordHash64(word);
+  const struct mph_slot *slot = &params->mph_slots[GetPerfectHashSlot(h,
+      params->mph_pilot[(h >> 32) % params->mph_num_buckets], params->vocab_size)];
+  return slot->fingerprint == h ? slot->word : -1;
+}
+
 // Returns position of a word in the vocabulary; if the word is not found, returns -1
-int SearchVocab(char *word, const struct vocab_word *vocab, const int *vocab_hash) {
+int SearchVocab(char *word, const struct lang_params *params) {
   // puts("     Searching vocab...");
+  if (params->mph_slots != NULL) return SearchVocabPerfect(word, params);
+  const int *vocab_hash = params->vocab_hash;
   unsigned int hash = GetWordHash(word);
   int original_hash = hash;
   while (1) {
     if (vocab_hash[hash] == -1) return -1;
     if (global_debug_flag) {
-      printf("Hash is now %d (%s), vs the original hash of %d", hash, vocab[vocab_hash[hash]].word, original_hash);
+      printf("Hash is now %d (%s), vs the original hash of %d", hash, GetVocabWord(params, vocab_hash[hash]), original_hash);
     }
-    if (!strcmp(word, vocab[vocab_hash[hash]].word)) {
+    if (!strcmp(word, GetVocabWord(params, vocab_hash[hash]))) {
       return vocab_hash[hash];
     }
     hash = (hash + 1) % vocab_hash_size;
@@ -362,13 +644,28 @@ int SearchVocab(char *word, const struct vocab_word *vocab, const int *vocab_has
 }
 
 // Reads a word and returns its index in the vocabulary
-int ReadWordIndex(FILE *fin, const struct vocab_word *vocab, const int *vocab_hash) {
+int ReadWordIndex(FILE *fin, const struct lang_params *params) {
   char word[MAX_STRING];
   int word_len = ReadWord(word, fin);
   if(word_len >= MAX_STRING - 2) printf("! long word: %s\n", word);
 
   if (feof(fin)) return -1;
-  return SearchVocab(word, vocab, vocab_hash);
+  return SearchVocab(word, params);
+}
+
+// Appends the first length-1 characters of word to the string arena, growing it geometrically
+// Returns the offset of the copy
+long long AppendVocabString(char *word, unsigned int length, struct lang_params *params) {
+  long long offset = params->vocab_strings_size;
+  if (params->vocab_strings_size + length > params->vocab_strings_max_size) {
+    params->vocab_strings_max_size = (params->vocab_strings_max_size + length) * 2;
+    params->vocab_strings = (char *)realloc(params->vocab_strings, params->vocab_strings_max_size);
+    if (params->vocab_strings == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  }
+  memcpy(params->vocab_strings + offset, word, length - 1);
+  params->vocab_strings[offset + length - 1] = 0;
+  params->vocab_strings_size += length;
+  return offset;
 }
 
 // Adds a word to the vocabulary
@@ -376,19 +673,17 @@ int AddWordToVocab(char *word, struct lang_params *params) {
   // puts("Adding word to vocab");
   unsigned int hash, length = strlen(word) + 1;
   long long vocab_size = params->vocab_size;
-  long long vocab_max_size = params->vocab_max_size;
-  struct vocab_word *vocab = params->vocab;
   int *vocab_hash = params->vocab_hash;
 
   if (length > MAX_STRING) length = MAX_STRING;
-  vocab[vocab_size].word = (char *)calloc(length, sizeof(char));
-  strcpy(vocab[vocab_size].word, word);
-  vocab[vocab_size].cn = 0;
+  params->vocab_word[vocab_size] = AppendVocabString(word, length, params);
+  params->vocab_cn[vocab_size] = 0;
   vocab_size++;
   // Reallocate memory if needed
-  if (vocab_size + 2 >= vocab_max_size) {
-    vocab_max_size += 1000;
-    vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
+  if (vocab_size + 2 >= params->vocab_max_size) {
+    params->vocab_max_size += 1000;
+    params->vocab_cn = (long long *)realloc(params->vocab_cn, params->vocab_max_size * sizeof(long long));
+    params->vocab_word = (long long *)realloc(params->vocab_word, params->vocab_max_size * sizeof(long long));
   }
   hash = GetWordHash(word);
   while (vocab_hash[hash] != -1) {
@@ -396,83 +691,250 @@ int AddWordToVocab(char *word, struct lang_params *params) {
   }
   vocab_hash[hash] = vocab_size - 1;
   params->vocab_size = vocab_size;
-  params->vocab_max_size = vocab_max_size;
-  params->vocab = vocab;
   return vocab_size - 1;
 }
 
-// Used later for sorting by word counts
+// (count, id) pairs, used to sort the vocabulary without moving the words themselves
+struct vocab_sort_entry {
+  long long cn;
+  long long word;
+};
+
+// Used later for sorting by word counts; ties keep their original order
 int VocabCompare(const void *a, const void *b) {
-    return ((struct vocab_word *)b)->cn - ((struct vocab_word *)a)->cn;
+  const struct vocab_sort_entry *x = a, *y = b;
+  if (x->cn != y->cn) return (y->cn > x->cn) ? 1 : -1;
+  return (x->word > y->word) - (x->word < y->word);
+}
+
+// Recomputes the hash table from the vocab arrays
+void RehashVocab(struct lang_params *params) {
+  long long a;
+  unsigned int hash;
+  for (a = 0; a < vocab_hash_size; a++) params->vocab_hash[a] = -1;
+  for (a = 0; a < params->vocab_size; a++) {
+    // Hash will be re-computed, as after the sorting it is not actual
+    hash = GetWordHash(GetVocabWord(params, a));
+    while (params->vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
+    params->vocab_hash[hash] = a;
+  }
+}
+
+// Rebuilds the vocab arrays and the string arena so that they hold exactly the given word ids,
+// in the given order, and recomputes the hash table
+void RebuildVocab(struct lang_params *params, const long long *words, long long num_words) {
+  long long a, length, strings_size = 0;
+  long long *vocab_cn = (long long *)malloc(params->vocab_max_size * sizeof(long long));
+  long long *vocab_word = (long long *)malloc(params->vocab_max_size * sizeof(long long));
+  char *vocab_strings;
+
+  for (a = 0; a < num_words; a++) strings_size += strlen(GetVocabWord(params, words[a])) + 1;
+  vocab_strings = (char *)malloc(strings_size + 1);
+  if (vocab_cn == NULL || vocab_word == NULL || vocab_strings == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  strings_size = 0;
+  for (a = 0; a < num_words; a++) {
+    length = strlen(GetVocabWord(params, words[a])) + 1;
+    memcpy(vocab_strings + strings_size, GetVocabWord(params, words[a]), length);
+    vocab_cn[a] = params->vocab_cn[words[a]];
+    vocab_word[a] = strings_size;
+    strings_size += length;
+  }
+  free(params->vocab_cn);
+  free(params->vocab_word);
+  free(params->vocab_strings);
+  params->vocab_cn = vocab_cn;
+  params->vocab_word = vocab_word;
+  params->vocab_strings = vocab_strings;
+  params->vocab_strings_size = strings_size;
+  params->vocab_strings_max_size = strings_size + 1;
+  params->vocab_size = num_words;
+  RehashVocab(params);
 }
 
 // Sorts the vocabulary by frequency using word counts
 void SortVocab(struct lang_params *params) {
-  int a, size;
-  unsigned int hash;
-  int *vocab_hash = params->vocab_hash;
-  struct vocab_word *vocab = params->vocab;
+  long long a, size = 0;
   long long vocab_size = params->vocab_size;
+  struct vocab_sort_entry *entries = (struct vocab_sort_entry *)malloc(vocab_size * sizeof(struct vocab_sort_entry));
+  long long *words = (long long *)malloc(vocab_size * sizeof(long long));
 
   // Sort the vocabulary and keep </s> at the first position
-  qsort(&vocab[1], vocab_size - 1, sizeof(struct vocab_word), VocabCompare);
-  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
-  size = vocab_size;
-  params->total_words = 0;
-  for (a = 0; a < size; a++) {
-    // Words occuring less than min_count times will be discarded from the vocab
-    if ((vocab[a].cn < min_count) && (a != 0)){ // a=0 is </s> and we want to keep it.
-      vocab_size--;
-      free(vocab[a].word);
-    } else {
-      // Hash will be re-computed, as after the sorting it is not actual
-      hash=GetWordHash(vocab[a].word);
-      while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-      vocab_hash[hash] = a;
-      params->total_words += vocab[a].cn;
-    }
+  for (a = 0; a < vocab_size; a++) {
+    entries[a].cn = params->vocab_cn[a];
+    entries[a].word = a;
   }
-  vocab = (struct vocab_word *)realloc(vocab, (vocab_size + 1) * sizeof(struct vocab_word));
-  // Allocate memory for the binary tree construction
+  qsort(&entries[1], vocab_size - 1, sizeof(struct vocab_sort_entry), VocabCompare);
+  params->total_words = 0;
   for (a = 0; a < vocab_size; a++) {
-    vocab[a].code = (char *)calloc(MAX_CODE_LENGTH, sizeof(char));
-    vocab[a].point = (int *)calloc(MAX_CODE_LENGTH, sizeof(int));
+    // Words occuring less than min_count times will be discarded from the vocab
+    if ((entries[a].cn < min_count) && (a != 0)) continue; // a=0 is </s> and we want to keep it.
+    words[size++] = entries[a].word;
+    params->total_words += entries[a].cn;
   }
-
-  params->vocab = vocab;
-  params->vocab_size = vocab_size;
+  params->vocab_max_size = size + 1;
+  RebuildVocab(params, words, size);
+  free(entries);
+  free(words);
 }
 
 // Reduces the vocabulary by removing infrequent tokens
 void ReduceVocab(struct lang_params *params) {
-  int a, b = 0;
-  unsigned int hash;
-  for (a = 0; a < params->vocab_size; a++) if (params->vocab[a].cn > min_reduce) {
-    params->vocab[b].cn = params->vocab[a].cn;
-    params->vocab[b].word = params->vocab[a].word;
-    b++;
-  } else free(params->vocab[a].word);
-  params->vocab_size = b;
-  for (a = 0; a < vocab_hash_size; a++) params->vocab_hash[a] = -1;
-  for (a = 0; a < params->vocab_size; a++) {
-    // Hash will be re-computed, as it is not actual
-    hash = GetWordHash(params->vocab[a].word);
-    while (params->vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
-    params->vocab_hash[hash] = a;
-  }
+  long long a, b = 0;
+  long long *words = (long long *)malloc(params->vocab_size * sizeof(long long));
+  for (a = 0; a < params->vocab_size; a++) if (params->vocab_cn[a] > min_reduce) words[b++] = a;
+  RebuildVocab(params, words, b);
+  free(words);
   fflush(stdout);
   min_reduce++;
 }
 
+// Space-Saving summary used by -vocab-budget (Metwally et al. 2005). At most vocab_budget words
+// are tracked; an unseen word replaces the least frequent tracked one and inherits its count + 1,
+// so counts are overestimated by at most error[word] and every word with a true frequency above
+// N / vocab_budget is guaranteed to be kept. The tracked words live in the normal vocab arrays;
+// heap is a min-heap of word ids keyed by vocab_cn. </s> (id 0) is pinned and never evicted.
+struct space_saving {
+  long long *heap;
+  long long *heap_pos; // position of each word id in heap
+  long long *error;    // overestimation bound of each word's count
+  long long size;
+  long long garbage;   // bytes of evicted words still in the string arena
+  long long evictions;
+};
+
+void SpaceSavingInit(struct space_saving *summary, long long capacity) {
+  summary->heap = (long long *)malloc((capacity + 1) * sizeof(long long));
+  summary->heap_pos = (long long *)malloc((capacity + 1) * sizeof(long long));
+  summary->error = (long long *)calloc(capacity + 1, sizeof(long long));
+  if (summary->heap == NULL || summary->heap_pos == NULL || summary->error == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  summary->size = 0;
+  summary->garbage = 0;
+  summary->evictions = 0;
+}
+
+void SpaceSavingFree(struct space_saving *summary) {
+  free(summary->heap);
+  free(summary->heap_pos);
+  free(summary->error);
+}
+
+void SpaceSavingSwap(struct space_saving *summary, long long a, long long b) {
+  long long tmp = summary->heap[a];
+  summary->heap[a] = summary->heap[b];
+  summary->heap[b] = tmp;
+  summary->heap_pos[summary->heap[a]] = a;
+  summary->heap_pos[summary->heap[b]] = b;
+}
+
+// Restores the heap order after the count at heap position a went up
+void SpaceSavingSiftDown(struct space_saving *summary, long long a, const long long *vocab_cn) {
+  long long child;
+  while ((child = 2 * a + 1) < summary->size) {
+    if (child + 1 < summary->size && vocab_cn[summary->heap[child + 1]] < vocab_cn[summary->heap[child]]) child++;
+    if (vocab_cn[summary->heap[a]] <= vocab_cn[summary->heap[child]]) break;
+    SpaceSavingSwap(summary, a, child);
+    a = child;
+  }
+}
+
+void SpaceSavingSiftUp(struct space_saving *summary, long long a, const long long *vocab_cn) {
+  while (a > 0 && vocab_cn[summary->heap[a]] < vocab_cn[summary->heap[(a - 1) / 2]]) {
+    SpaceSavingSwap(summary, a, (a - 1) / 2);
+    a = (a - 1) / 2;
+  }
+}
+
+// Removes word id from the hash table, shifting later entries of its probe run back so that
+// linear probing still finds them
+void RemoveWordFromHash(long long id, struct lang_params *params) {
+  int *vocab_hash = params->vocab_hash;
+  unsigned int i = GetWordHash(GetVocabWord(params, id)), j, k;
+  while (vocab_hash[i] != id) i = (i + 1) % vocab_hash_size;
+  vocab_hash[i] = -1;
+  j = i;
+  while (1) {
+    j = (j + 1) % vocab_hash_size;
+    if (vocab_hash[j] == -1) break;
+    k = GetWordHash(GetVocabWord(params, vocab_hash[j]));
+    // move the entry at j into the hole unless its home slot k lies cyclically in (i, j]
+    if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j)) continue;
+    vocab_hash[i] = vocab_hash[j];
+    vocab_hash[j] = -1;
+    i = j;
+  }
+}
+
+// Rewrites the string arena in word id order, dropping the strings of evicted words
+void CompactVocabStrings(struct lang_params *params) {
+  long long a, length, strings_size = 0;
+  char *vocab_strings = (char *)malloc(params->vocab_strings_max_size);
+  if (vocab_strings == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < params->vocab_size; a++) {
+    length = strlen(GetVocabWord(params, a)) + 1;
+    memcpy(vocab_strings + strings_size, GetVocabWord(params, a), length);
+    params->vocab_word[a] = strings_size;
+    strings_size += length;
+  }
+  free(params->vocab_strings);
+  params->vocab_strings = vocab_strings;
+  params->vocab_strings_size = strings_size;
+}
+
+// Counts one occurrence of word, whose current id is i (-1 if it is not tracked)
+void SpaceSavingCount(char *word, long long i, struct space_saving *summary, struct lang_params *params) {
+  unsigned int hash, length;
+  long long victim;
+  if (i == 0) { // </s>
+    params->vocab_cn[0]++;
+    return;
+  }
+  if (i != -1) {
+    params->vocab_cn[i]++;
+    SpaceSavingSiftDown(summary, summary->heap_pos[i], params->vocab_cn);
+    return;
+  }
+  if (params->vocab_size - 1 < vocab_budget) {
+    i = AddWordToVocab(word, params);
+    params->vocab_cn[i] = 1;
+    summary->error[i] = 0;
+    summary->heap[summary->size] = i;
+    summary->heap_pos[i] = summary->size;
+    summary->size++;
+    SpaceSavingSiftUp(summary, summary->size - 1, params->vocab_cn);
+    return;
+  }
+  // Replace the least frequent tracked word
+  victim = summary->heap[0];
+  RemoveWordFromHash(victim, params);
+  summary->garbage += strlen(GetVocabWord(params, victim)) + 1;
+  length = strlen(word) + 1;
+  if (length > MAX_STRING) length = MAX_STRING;
+  params->vocab_word[victim] = AppendVocabString(word, length, params);
+  hash = GetWordHash(GetVocabWord(params, victim));
+  while (params->vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
+  params->vocab_hash[hash] = victim;
+  summary->error[victim] = params->vocab_cn[victim];
+  params->vocab_cn[victim]++;
+  SpaceSavingSiftDown(summary, 0, params->vocab_cn);
+  summary->evictions++;
+  if (summary->garbage > params->vocab_strings_size / 2) {
+    CompactVocabStrings(params);
+    summary->garbage = 0;
+  }
+}
+
 // Create binary Huffman tree using the word counts
 // Frequent words will have short uniqe binary codes
+// Only needed for hierarchical softmax; the codes and points of all words are stored back to
+// back in vocab_code / vocab_point, starting at vocab_path[word]
 void CreateBinaryTree(struct lang_params *params) {
   long long a, b, i, min1i, min2i, pos1, pos2, point[MAX_CODE_LENGTH];
+  long long path_size = 0;
   char code[MAX_CODE_LENGTH];
   long long *count = (long long *)calloc(params->vocab_size * 2 + 1, sizeof(long long));
   long long *binary = (long long *)calloc(params->vocab_size * 2 + 1, sizeof(long long));
   long long *parent_node = (long long *)calloc(params->vocab_size * 2 + 1, sizeof(long long));
-  for (a = 0; a < params->vocab_size; a++) count[a] = params->vocab[a].cn;
+  for (a = 0; a < params->vocab_size; a++) count[a] = params->vocab_cn[a];
   for (a = params->vocab_size; a < params->vocab_size * 2; a++) count[a] = 1e15;
   pos1 = params->vocab_size - 1;
   pos2 = params->vocab_size;
@@ -508,8 +970,28 @@ void CreateBinaryTree(struct lang_params *params) {
     parent_node[min2i] = params->vocab_size + a;
     binary[min2i] = 1;
   }
+  // Measure the code length of each word so the paths can be laid out contiguously
+  params->vocab_codelen = (char *)malloc(params->vocab_size * sizeof(char));
+  params->vocab_path = (long long *)malloc(params->vocab_size * sizeof(long long));
+  for (a = 0; a < params->vocab_size; a++) {
+    b = a;
+    i = 0;
+    while (1) {
+      i++;
+      b = parent_node[b];
+      if (b == params->vocab_size * 2 - 2) break;
+    }
+    params->vocab_codelen[a] = i;
+    params->vocab_path[a] = path_size;
+    path_size += i;
+  }
+  params->vocab_code = (char *)malloc(path_size * sizeof(char));
+  params->vocab_point = (int *)malloc(path_size * sizeof(int));
+  if (params->vocab_code == NULL || params->vocab_point == NULL) {printf("Memory allocation failed\n"); exit(1);}
   // Now assign binary code to each vocabulary word
   for (a = 0; a < params->vocab_size; a++) {
+    char *word_code = params->vocab_code + params->vocab_path[a];
+    int *word_point = params->vocab_point + params->vocab_path[a];
     b = a;
     i = 0;
     while (1) {
@@ -519,11 +1001,11 @@ void CreateBinaryTree(struct lang_params *params) {
       b = parent_node[b];
       if (b == params->vocab_size * 2 - 2) break;
     }
-    params->vocab[a].codelen = i;
-    params->vocab[a].point[0] = params->vocab_size - 2;
+    word_point[0] = params->vocab_size - 2;
     for (b = 0; b < i; b++) {
-      params->vocab[a].code[i - b - 1] = code[b];
-      params->vocab[a].point[i - b] = point[b] - params->vocab_size;
+      word_code[i - b - 1] = code[b];
+      // point[0] is the leaf itself, which is never used as an output node
+      if (b > 0) word_point[i - b] = point[b] - params->vocab_size;
     }
   }
   free(count);
@@ -531,35 +1013,277 @@ void CreateBinaryTree(struct lang_params *params) {
   free(parent_node);
 }
 
-void CountWordsFromTrainFile(struct file_params *params) {
-  char word[MAX_STRING];
-  FILE *fin;
+// Training and alignment files ending in .gz or .xz are read through a gzip / xz process, so decoding
+// runs in parallel with the thread reading them
+int IsCompressedFile(char *file_name) {
+  int len = strlen(file_name);
+  return len > 3 && (!strcmp(file_name + len - 3, ".gz") || !strcmp(file_name + len - 3, ".xz"));
+}
 
-  if (debug_mode > 0) printf("# Count words from %s\n", params->train_file);
+// Opens a training or alignment file for reading; returns NULL if it does not exist
+FILE *OpenInputFile(char *file_name) {
+  char *command, *p, *c;
+  FILE *f = fopen(file_name, "rb");
+  if (f == NULL || !IsCompressedFile(file_name)) return f;
+  fclose(f);
+  // the name is single-quoted for the shell, each ' in it written as '\''
+  command = (char *)malloc(4 * strlen(file_name) + 16);
+  p = command + sprintf(command, "%s -dc '", strcmp(file_name + strlen(file_name) - 3, ".xz") ? "gzip" : "xz");
+  for (c = file_name; *c; c++) {
+    if (*c == '\'') p += sprintf(p, "'\\''");
+    else *p++ = *c;
+  }
+  strcpy(p, "'");
+  f = popen(command, "r");
+  free(command);
+  return f;
+}
+
+void CloseInputFile(FILE *f, char *file_name) {
+  if (IsCompressedFile(file_name)) pclose(f);
+  else fclose(f);
+}
+
+// Moves to offset, counted in uncompressed bytes; compressed streams are decoded up to it
+void SeekInputFile(FILE *f, char *file_name, long long offset) {
+  char buf[65536];
+  long long n;
+  if (!IsCompressedFile(file_name)) {
+    fseek(f, offset, SEEK_SET);
+    return;
+  }
+  while (offset > 0 && (n = fread(buf, 1, offset < 65536 ? offset : 65536, f)) > 0) offset -= n;
+}
+
+// Pipes can only be read once, from the start: they are not indexed, split or used to learn the vocab
+int IsStreamFile(char *file_name) {
+  struct stat st;
+  return stat(file_name, &st) == 0 && !S_ISREG(st.st_mode);
+}
+
+// Binary alignment files start with ALIGN_MAGIC, followed by one record per sentence: a uint16 link
+// count and that many (src_pos, tgt_pos) uint16 pairs, in host byte order. Written by -convert-align.
+int IsBinaryAlignFile(char *file_name) {
+  char magic[8];
+  int binary = 0;
+  FILE *f = OpenInputFile(file_name);
+  if (f == NULL) return 0;
+  if (fread(magic, 1, 8, f) == 8 && !memcmp(magic, ALIGN_MAGIC, 8)) binary = 1;
+  CloseInputFile(f, file_name);
+  return binary;
+}
+
+// Reads the links of the next line of a text alignment file ("src tgt src tgt ...") into links.
+// Returns the number of links, or -1 at end of file; links with a position above 65535 are dropped.
+int ReadAlignLinksText(FILE *fin, unsigned short *links) {
+  int ch, num_links = 0, num_values = 0, in_number = 0;
+  long long value = 0, src_pos = 0;
+  while (1) {
+    ch = getc_unlocked(fin);
+    if (ch >= '0' && ch <= '9') {
+      if (value <= MAX_ALIGN_LINKS) value = value * 10 + ch - '0';
+      in_number = 1;
+      continue;
+    }
+    if (in_number) {
+      if (num_values++ % 2 == 0) src_pos = value;
+      else if (src_pos <= MAX_ALIGN_LINKS && value <= MAX_ALIGN_LINKS && num_links < MAX_ALIGN_LINKS) {
+        links[2 * num_links] = src_pos;
+        links[2 * num_links + 1] = value;
+        num_links++;
+      }
+      value = 0;
+      in_number = 0;
+    }
+    if (ch == '\n') return num_links;
+    if (ch == EOF) return num_values ? num_links : -1;
+  }
+}
+
+// Binary counterpart of ReadAlignLinksText
+int ReadAlignLinksBinary(FILE *fin, unsigned short *links) {
+  unsigned short num_links;
+  if (fread(&num_links, sizeof(unsigned short), 1, fin) != 1) return -1;
+  if (fread(links, 2 * sizeof(unsigned short), num_links, fin) != num_links) return -1;
+  return num_links;
+}
+
+// Rewrites a text alignment file in the binary format
+void ConvertAlignFile(char *text_file, char *binary_file) {
+  unsigned short *links = (unsigned short *)malloc(2 * MAX_ALIGN_LINKS * sizeof(unsigned short));
+  unsigned short num_links;
+  long long num_lines = 0, total_links = 0;
+  int n;
+  FILE *fin = OpenInputFile(text_file), *fo;
+  if (fin == NULL) {
+    printf("ERROR: alignment file %s not found!\n", text_file);
+    exit(1);
+  }
+  fo = fopen(binary_file, "wb");
+  if (fo == NULL) {
+    printf("ERROR: cannot write %s\n", binary_file);
+    exit(1);
+  }
+  fwrite(ALIGN_MAGIC, 1, 8, fo);
+  while ((n = ReadAlignLinksText(fin, links)) >= 0) {
+    num_links = n;
+    fwrite(&num_links, sizeof(unsigned short), 1, fo);
+    fwrite(links, 2 * sizeof(unsigned short), num_links, fo);
+    num_lines++;
+    total_links += n;
+  }
+  CloseInputFile(fin, text_file);
+  fclose(fo);
+  free(links);
+  printf("Converted %lld lines (%lld links) from %s to %s\n", num_lines, total_links, text_file, binary_file);
+}
+
+// Line index of a corpus or alignment file, persisted next to it as <file>.lidx so that unchanged
+// files are never rescanned at startup. offsets[k] is the byte offset of line k * stride, and
+// num_words counts tokens the way ReadWord does (one </s> per line).
+// Sidecar layout: "LIDX0001", then file_size, mtime (in nanoseconds), stride, num_lines, num_words,
+// eof_offset (long long) and the num_lines / stride + 1 offsets.
+struct line_index {
+  long long file_size, mtime, stride, num_lines, num_words, eof_offset;
+  long long *offsets;
+};
+
+// Binary alignment files are indexed by record, one per sentence; num_words counts links
+void ScanAlignIndex(FILE *fin, struct line_index *index, long long max_offsets) {
+  unsigned short *links = (unsigned short *)malloc(2 * MAX_ALIGN_LINKS * sizeof(unsigned short));
+  long long pos = 8;
+  char magic[8];
+  int n;
+  if (fread(magic, 1, 8, fin) != 8) pos = 0;
+  index->offsets[0] = pos;
+  while ((n = ReadAlignLinksBinary(fin, links)) >= 0) {
+    pos += sizeof(unsigned short) + 2 * sizeof(unsigned short) * n;
+    index->num_words += n;
+    index->num_lines++;
+    if (index->num_lines % index->stride == 0) {
+      if (index->num_lines / index->stride >= max_offsets) {
+        max_offsets *= 2;
+        index->offsets = (long long *)realloc(index->offsets, max_offsets * sizeof(long long));
+      }
+      index->offsets[index->num_lines / index->stride] = pos;
+    }
+  }
+  index->eof_offset = pos;
+  free(links);
+}
 
-  fin = fopen(params->train_file, "rb");
+void ScanLineIndex(char *file_name, struct line_index *index) {
+  char *buf;
+  long long a, n, pos = 0, max_offsets = 1024;
+  int in_word = 0;
+  FILE *fin = OpenInputFile(file_name);
   if (fin == NULL) {
-    printf("ERROR: training data file not found!\n");
+    printf("ERROR: training data file %s not found!\n", file_name);
     exit(1);
   }
+  if (debug_mode > 0) printf("# Scanning %s\n", file_name);
+  index->num_lines = 0;
+  index->num_words = 0;
+  index->offsets = (long long *)malloc(max_offsets * sizeof(long long));
+  if (IsBinaryAlignFile(file_name)) {
+    ScanAlignIndex(fin, index, max_offsets);
+    CloseInputFile(fin, file_name);
+    return;
+  }
+  buf = (char *)malloc(1 << 20);
+  index->offsets[0] = 0;
+  while ((n = fread(buf, 1, 1 << 20, fin)) > 0) {
+    for (a = 0; a < n; a++, pos++) {
+      char ch = buf[a];
+      if (ch == 13) continue;
+      if (ch == ' ' || ch == '\t' || ch == '\n') {
+        if (in_word) index->num_words++;
+        in_word = 0;
+        if (ch != '\n') continue;
+        index->num_words++; // </s>
+        index->num_lines++;
+        if (index->num_lines % index->stride == 0) {
+          if (index->num_lines / index->stride >= max_offsets) {
+            max_offsets *= 2;
+            index->offsets = (long long *)realloc(index->offsets, max_offsets * sizeof(long long));
+          }
+          index->offsets[index->num_lines / index->stride] = pos + 1;
+        }
+        index->eof_offset = pos + 1;
+      } else in_word = 1;
+    }
+  }
+  if (index->num_lines == 0) index->eof_offset = 0;
+  CloseInputFile(fin, file_name);
+  free(buf);
+}
 
-  while (1) {
-    //puts("Reading word");
-    //printf("Debug mode: %d\n", debug_mode);
-    //printf("File size: %lld\n", params->file_size);
-    ReadWord(word, fin);
-    if (feof(fin)) break;
-    params->train_words++;
-    if ((debug_mode > 1) && (params->train_words % 100000 == 0)) {
-      printf("%lldK%c", params->train_words / 1000, 13);
-      fflush(stdout);
+// Fills index for file_name, from its sidecar if that is still valid, otherwise by scanning the
+// file once and writing a fresh sidecar
+void LoadLineIndex(char *file_name, struct line_index *index) {
+  char index_file[MAX_STRING], magic[8];
+  long long header[6], num_offsets;
+  long long mtime;
+  struct stat st;
+  FILE *f;
+
+  if (stat(file_name, &st) != 0) {
+    printf("ERROR: training data file %s not found!\n", file_name);
+    exit(1);
+  }
+  mtime = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  sprintf(index_file, "%s.lidx", file_name);
+  f = fopen(index_file, "rb");
+  if (f != NULL) {
+    if (fread(magic, 1, 8, f) == 8 && !memcmp(magic, "LIDX0001", 8) && fread(header, sizeof(long long), 6, f) == 6 &&
+        header[0] == (long long)st.st_size && header[1] == mtime && header[2] == line_index_stride) {
+      index->file_size = header[0];
+      index->mtime = header[1];
+      index->stride = header[2];
+      index->num_lines = header[3];
+      index->num_words = header[4];
+      index->eof_offset = header[5];
+      num_offsets = index->num_lines / index->stride + 1;
+      index->offsets = (long long *)malloc(num_offsets * sizeof(long long));
+      if (fread(index->offsets, sizeof(long long), num_offsets, f) == num_offsets) {
+        fclose(f);
+        if (debug_mode > 0) printf("# Loaded line index %s\n", index_file);
+        return;
+      }
+      free(index->offsets);
     }
+    fclose(f);
+  }
+
+  index->file_size = st.st_size;
+  index->mtime = mtime;
+  index->stride = line_index_stride;
+  ScanLineIndex(file_name, index);
+  f = fopen(index_file, "wb");
+  if (f == NULL) {
+    printf("! Cannot write line index %s\n", index_file);
+    return;
   }
+  header[0] = index->file_size; header[1] = index->mtime; header[2] = index->stride;
+  header[3] = index->num_lines; header[4] = index->num_words; header[5] = index->eof_offset;
+  fwrite("LIDX0001", 1, 8, f);
+  fwrite(header, sizeof(long long), 6, f);
+  fwrite(index->offsets, sizeof(long long), index->num_lines / index->stride + 1, f);
+  fclose(f);
+}
+
+void CountWordsFromTrainFile(struct file_params *params) {
+  struct line_index index;
+
+  if (debug_mode > 0) printf("# Count words from %s\n", params->train_file);
+  LoadLineIndex(params->train_file, &index);
+  params->train_words = index.num_words; // LearnVocabFromTrainFiles may have counted them already
   if (debug_mode > 0) {
     printf("  Words in train file: %lld\n", params->train_words);
   }
-  params->file_size = ftell(fin);
-  fclose(fin);
+  params->file_size = index.file_size;
+  params->num_lines = index.num_lines;
+  free(index.offsets);
 }
 
 
@@ -570,23 +1294,31 @@ void LearnVocabFromTrainFiles(struct lang_params *params) {
   FILE *fin;
   long long a, i;
 
+  struct space_saving summary;
+
   for (a = 0; a < vocab_hash_size; a++) params->vocab_hash[a] = -1;
   puts("Vocabulary set to -1");
+  if (vocab_budget > 0) {
+    printf("# Approximate vocab counting, tracking at most %lld words\n", vocab_budget);
+    SpaceSavingInit(&summary, vocab_budget);
+  }
+  params->vocab_size = 0;
+  AddWordToVocab((char *)"</s>", params);
   for (ll1=0; ll1 < (params->num_files); ll1++) {
     struct file_params *file = params->files[ll1];
+    if (IsStreamFile(file->train_file)) {
+      printf("# Not learning vocab for %s from %s, which is a pipe\n", params->lang_name, file->train_file);
+      continue;
+    }
     if (debug_mode > 0) {
       printf("# Learn vocab for %s from %s (file %d of %d)\n", params->lang_name, file->train_file, ll1+1, params->num_files);
     }
-    fin = fopen(file->train_file, "rb");
+    fin = OpenInputFile(file->train_file);
     if (fin == NULL) {
       printf("ERROR: training data file not found!\n");
       exit(1);
     }
 
-    if (ll1 == 0) {
-      params->vocab_size = 0;
-      AddWordToVocab((char *)"</s>", params);
-    }
     while (1) {
       ReadWord(word, fin);
       if (feof(fin)) break;
@@ -595,12 +1327,16 @@ void LearnVocabFromTrainFiles(struct lang_params *params) {
         printf("%lldK%c", file->train_words / 1000, 13);
         fflush(stdout);
       }
-      i = SearchVocab(word, params->vocab, params->vocab_hash);
+      i = SearchVocab(word, params);
 
+      if (vocab_budget > 0) {
+        SpaceSavingCount(word, i, &summary, params);
+        continue;
+      }
       if (i == -1) {
         a = AddWordToVocab(word, params);
-        params->vocab[a].cn = 1;
-      } else params->vocab[i].cn++;
+        params->vocab_cn[a] = 1;
+      } else params->vocab_cn[i]++;
       if (params->vocab_size > vocab_hash_size * 0.7) ReduceVocab(params);
     }
     //used to have SortVocab here - revert if broken
@@ -610,7 +1346,13 @@ void LearnVocabFromTrainFiles(struct lang_params *params) {
       printf("  Words in train file: %lld\n", file->train_words);
     }
     file->file_size = ftell(fin);
-    fclose(fin);
+    CloseInputFile(fin, file->train_file);
+  }
+  if (vocab_budget > 0) {
+    long long max_error = 0;
+    for (a = 1; a < params->vocab_size; a++) if (summary.error[a] > max_error) max_error = summary.error[a];
+    printf("  Evictions: %lld, max count error: %lld\n", summary.evictions, max_error);
+    SpaceSavingFree(&summary);
   }
   SortVocab(params);
   printf("Finished learning vocab for language %s\n", params->lang_name);
@@ -620,7 +1362,7 @@ void LearnVocabFromTrainFiles(struct lang_params *params) {
 void SaveVocab(struct lang_params *params) {
   long long i;
   FILE *fo = fopen(params->vocab_file, "wb");
-  for (i = 0; i < params->vocab_size; i++) fprintf(fo, "%s %lld\n", params->vocab[i].word, params->vocab[i].cn);
+  for (i = 0; i < params->vocab_size; i++) fprintf(fo, "%s %lld\n", GetVocabWord(params, i), params->vocab_cn[i]);
   fclose(fo);
 }
 
@@ -639,7 +1381,7 @@ void ReadVocab(struct lang_params *params) {
     ReadWord(word, fin);
     if (feof(fin)) break;
     a = AddWordToVocab(word, params);
-    fscanf(fin, "%lld%c", &params->vocab[a].cn, &c);
+    fscanf(fin, "%lld%c", &params->vocab_cn[a], &c);
     i++;
   }
   SortVocab(params);
@@ -661,55 +1403,210 @@ void ReadVocab(struct lang_params *params) {
   params->full_vocab = 1;
 }
 
+// Used for sorting perfect hash buckets by decreasing size
+int BucketCompare(const void *a, const void *b) {
+  const long long *x = a, *y = b; // {size, first key, bucket}
+  if (x[0] != y[0]) return (y[0] > x[0]) ? 1 : -1;
+  return (x[2] > y[2]) - (x[2] < y[2]);
+}
+
+// Used for grouping word hashes by bucket
+int HashCompare(const void *a, const void *b) {
+  const unsigned long long *x = a, *y = b; // {bucket, hash, word}
+  if (x[0] != y[0]) return (x[0] > y[0]) - (x[0] < y[0]);
+  return (x[1] > y[1]) - (x[1] < y[1]);
+}
+
+// Builds a minimal perfect hash over the final vocabulary (PTHash-style: words are split into
+// buckets of ~4, and each bucket, largest first, gets the smallest pilot that sends all of its
+// words to free slots). Returns 0 if two words share a 64-bit hash, in which case the normal
+// hash table has to be kept.
+int BuildPerfectHash(struct lang_params *params) {
+  long long n = params->vocab_size, num_buckets = n / 4 + 1;
+  long long a, b, c, num_keys, slot;
+  unsigned int pilot;
+  unsigned long long *keys = (unsigned long long *)malloc(n * 3 * sizeof(unsigned long long));
+  long long *buckets = (long long *)calloc(num_buckets * 3, sizeof(long long));
+  long long *slots = NULL;
+  char *taken = (char *)calloc(n, sizeof(char));
+
+  params->mph_num_buckets = num_buckets;
+  params->mph_pilot = (unsigned int *)calloc(num_buckets, sizeof(unsigned int));
+  params->mph_slots = (struct mph_slot *)malloc(n * sizeof(struct mph_slot));
+  if (keys == NULL || buckets == NULL || taken == NULL || params->mph_slots == NULL) {printf("Memory allocation failed\n"); exit(1);}
+
+  for (a = 0; a < n; a++) {
+    keys[a * 3 + 1] = GetWordHash64(GetVocabWord(params, a));
+    keys[a * 3] = (keys[a * 3 + 1] >> 32) % num_buckets;
+    keys[a * 3 + 2] = a;
+  }
+  qsort(keys, n, 3 * sizeof(unsigned long long), HashCompare);
+  for (a = 0; a < num_buckets; a++) buckets[a * 3 + 2] = a;
+  for (a = n - 1; a >= 0; a--) {
+    if (a > 0 && keys[a * 3 + 1] == keys[(a - 1) * 3 + 1]) {
+      printf("! 64-bit hash collision between %s and %s, keeping the normal vocab hash\n",
+             GetVocabWord(params, keys[a * 3 + 2]), GetVocabWord(params, keys[(a - 1) * 3 + 2]));
+      free(params->mph_pilot); free(params->mph_slots);
+      params->mph_pilot = NULL; params->mph_slots = NULL;
+      free(keys); free(buckets); free(taken);
+      return 0;
+    }
+    buckets[keys[a * 3] * 3]++;
+    buckets[keys[a * 3] * 3 + 1] = a;
+  }
+  qsort(buckets, num_buckets, 3 * sizeof(long long), BucketCompare);
+  slots = (long long *)malloc(buckets[0] * sizeof(long long));
+
+  for (b = 0; b < num_buckets; b++) {
+    num_keys = buckets[b * 3];
+    if (num_keys == 0) break;
+    unsigned long long *bucket_keys = keys + buckets[b * 3 + 1] * 3;
+    for (pilot = 0; ; pilot++) {
+      for (a = 0; a < num_keys; a++) {
+        slots[a] = GetPerfectHashSlot(bucket_keys[a * 3 + 1], pilot, n);
+        if (taken[slots[a]]) break;
+        for (c = 0; c < a; c++) if (slots[c] == slots[a]) break;
+        if (c < a) break;
+      }
+      if (a == num_keys) break;
+    }
+    params->mph_pilot[buckets[b * 3 + 2]] = pilot;
+    for (a = 0; a < num_keys; a++) {
+      slot = slots[a];
+      taken[slot] = 1;
+      params->mph_slots[slot].fingerprint = bucket_keys[a * 3 + 1];
+      params->mph_slots[slot].word = bucket_keys[a * 3 + 2];
+    }
+  }
+  free(keys);
+  free(buckets);
+  free(slots);
+  free(taken);
+  return 1;
+}
+
+// Perfect hash file, stored next to the vocab file:
+//   "MPH1", vocab_size, num_buckets (long long), pilots (unsigned int), slots (struct mph_slot)
+void SavePerfectHash(struct lang_params *params) {
+  char mph_file[MAX_STRING + 8];
+  sprintf(mph_file, "%s.mph", params->vocab_file);
+  FILE *fo = fopen(mph_file, "wb");
+  if (fo == NULL) {
+    printf("! Cannot write perfect hash file %s\n", mph_file);
+    return;
+  }
+  fwrite("MPH1", 1, 4, fo);
+  fwrite(&params->vocab_size, sizeof(long long), 1, fo);
+  fwrite(&params->mph_num_buckets, sizeof(long long), 1, fo);
+  fwrite(params->mph_pilot, sizeof(unsigned int), params->mph_num_buckets, fo);
+  fwrite(params->mph_slots, sizeof(struct mph_slot), params->vocab_size, fo);
+  fclose(fo);
+}
+
+// Loads the perfect hash saved next to the vocab file, checking every slot's fingerprint
+// against the current vocab. Returns 0 if the file is missing or stale.
+int ReadPerfectHash(struct lang_params *params) {
+  char mph_file[MAX_STRING + 8], magic[4];
+  long long a, vocab_size, num_buckets;
+  sprintf(mph_file, "%s.mph", params->vocab_file);
+  FILE *fin = fopen(mph_file, "rb");
+  if (fin == NULL) return 0;
+  if (fread(magic, 1, 4, fin) != 4 || memcmp(magic, "MPH1", 4) ||
+      fread(&vocab_size, sizeof(long long), 1, fin) != 1 || vocab_size != params->vocab_size ||
+      fread(&num_buckets, sizeof(long long), 1, fin) != 1 || num_buckets <= 0) {
+    fclose(fin);
+    return 0;
+  }
+  params->mph_num_buckets = num_buckets;
+  params->mph_pilot = (unsigned int *)malloc(num_buckets * sizeof(unsigned int));
+  params->mph_slots = (struct mph_slot *)malloc(vocab_size * sizeof(struct mph_slot));
+  if (params->mph_pilot == NULL || params->mph_slots == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  a = (fread(params->mph_pilot, sizeof(unsigned int), num_buckets, fin) == num_buckets &&
+       fread(params->mph_slots, sizeof(struct mph_slot), vocab_size, fin) == vocab_size);
+  fclose(fin);
+  if (a) for (a = 0; a < vocab_size; a++) {
+    if (params->mph_slots[a].word < 0 || params->mph_slots[a].word >= vocab_size) break;
+    if (params->mph_slots[a].fingerprint != GetWordHash64(GetVocabWord(params, params->mph_slots[a].word))) break;
+  }
+  if (a != vocab_size) {
+    printf("# Perfect hash file %s does not match the vocab, rebuilding\n", mph_file);
+    free(params->mph_pilot); free(params->mph_slots);
+    params->mph_pilot = NULL; params->mph_slots = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+// Switches word lookups of a language with a final vocab to a minimal perfect hash, loading it
+// from the vocab's .mph file if possible. The probing hash table is freed afterwards.
+void FreezeVocab(struct lang_params *params) {
+  if (ReadPerfectHash(params)) {
+    printf("# Loaded perfect hash for %s\n", params->lang_name);
+  } else {
+    printf("# Building perfect hash for %s (%lld words)\n", params->lang_name, params->vocab_size);
+    if (!BuildPerfectHash(params)) return;
+    SavePerfectHash(params);
+  }
+  free(params->vocab_hash);
+  params->vocab_hash = NULL;
+}
+
+// Byte offset of line in f, a plain file: the indexed offset at or before it, then the lines in
+// between are skipped (records, if binary is a binary alignment file)
+long long LineOffset(FILE *f, int binary, struct line_index *index, long long line) {
+  long long pos = index->offsets[line / index->stride], skip = line % index->stride;
+  unsigned short *links;
+  int ch, n;
+  if (skip == 0) return pos;
+  fseeko(f, pos, SEEK_SET);
+  if (binary) {
+    links = (unsigned short *)malloc(2 * MAX_ALIGN_LINKS * sizeof(unsigned short));
+    for (; skip > 0 && (n = ReadAlignLinksBinary(f, links)) >= 0; skip--) pos += sizeof(unsigned short) * (1 + 2 * n);
+    free(links);
+  } else {
+    while (skip > 0 && (ch = fgetc(f)) != EOF) {
+      pos++;
+      if (ch == '\n') skip--;
+    }
+  }
+  return pos;
+}
+
 // To find split points in a file, so that later each thread can handle one chunk of the data
+// Block b starts exactly at line b * ceil(num_lines / num_blocks), so files with the same number of
+// lines are split at the same lines; the line index only says where to start skipping lines.
+// Compressed files are never split: with several threads the dispatcher reads them whole.
 void ComputeBlockStartPoints(char* file_name, int num_blocks, long long **blocks, long long *num_lines) {
   printf("# ComputeBlockStartPoints %s, num_blocks=%d\n", file_name, num_blocks);
-  long long block_size;
-  int line_count = 0;
-  int curr_block = 0;
-  char line[MAX_SENT_LEN];
-  FILE *file;
-
-  *num_lines = 0;
-  file = fopen(file_name, "r");
-  while (1) {
-    fgets(line, MAX_SENT_LEN, file);
-    if (feof(file)) break;
-    ++(*num_lines);
-  }
-  printf("  num_lines=%lld, eof position %lld\n", *num_lines, (long long) ftell(file));
+  long long block_size, line;
+  int curr_block, binary = num_blocks > 1 && IsBinaryAlignFile(file_name);
+  struct line_index index;
+  FILE *f = NULL;
+
+  assert(num_blocks == 1 || !IsCompressedFile(file_name));
+  LoadLineIndex(file_name, &index);
+  *num_lines = index.num_lines;
+  printf("  num_lines=%lld, eof position %lld\n", *num_lines, index.eof_offset);
 
-  fseek(file, 0, SEEK_SET);
   block_size = (*num_lines - 1) / num_blocks + 1;
-  printf("  block_size=%lld lines\n  blocks = [0", block_size);
+  printf("  block_size=%lld lines\n  blocks = [%lld", block_size, index.offsets[0]);
 
   *blocks = malloc((num_blocks+1) * sizeof(long long));
-  (*blocks)[0] = 0;
-  curr_block = 0;
-  long long int cur_size = 0;
-  while (1) {
-    fgets(line, MAX_SENT_LEN, file);
-    line_count++;
-    cur_size++;
-
-    // done with a block or reach eof
-    if (cur_size == block_size || line_count==(*num_lines)) {
-      curr_block++;
-      (*blocks)[curr_block] = (long long)ftell(file);
-      printf(" %lld", (*blocks)[curr_block]);
-      if (line_count==(*num_lines)) { // eof
-        break;
-      }
-
-      // reset
-      cur_size = 0;
+  (*blocks)[0] = index.offsets[0];
+  for (curr_block = 1; curr_block <= num_blocks; curr_block++) {
+    line = curr_block * block_size;
+    if (curr_block == num_blocks || line >= *num_lines) {
+      (*blocks)[curr_block] = index.eof_offset;
+    } else {
+      if (f == NULL) f = fopen(file_name, "rb");
+      (*blocks)[curr_block] = LineOffset(f, binary, &index, line);
     }
+    printf(" %lld", (*blocks)[curr_block]);
   }
   printf("]\n");
-  assert(curr_block==num_blocks);
-  assert(line_count==(*num_lines));
 
-  fclose(file);
+  if (f != NULL) fclose(f);
+  free(index.offsets);
 }
 
 
@@ -726,23 +1623,23 @@ void ProcessSkipPair(long long in_word, long long out_word, unsigned long long *
   real f, g;
   
 #ifdef DEBUG
-  //printf("  skip %s -> %s\n", in_params->vocab[in_word].word, out_params->vocab[out_word].word); fflush(stdout);
+  //printf("  skip %s -> %s\n", GetVocabWord(in_params, in_word), GetVocabWord(out_params, out_word)); fflush(stdout);
 #endif
 
   l1 = in_word * layer1_size;
   for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
 
   // HIERARCHICAL SOFTMAX
-  if (hs) for (d = 0; d < out_params->vocab[out_word].codelen; d++) {
+  if (hs) for (d = 0; d < out_params->vocab_codelen[out_word]; d++) {
     f = 0;
-    l2 = out_params->vocab[out_word].point[d] * layer1_size;
+    l2 = out_params->vocab_point[out_params->vocab_path[out_word] + d] * layer1_size;
     // Propagate hidden -> output
     for (c = 0; c < layer1_size; c++) f += in_params->syn0[c + l1] * out_params->syn1[c + l2];
     if (f <= -MAX_EXP) continue;
     else if (f >= MAX_EXP) continue;
     else f = expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
     // 'g' is the gradient multiplied by the learning rate
-    g = (1 - out_params->vocab[out_word].code[d] - f) * skip_alpha;
+    g = (1 - out_params->vocab_code[out_params->vocab_path[out_word] + d] - f) * skip_alpha;
     // Propagate errors output -> hidden
     for (c = 0; c < layer1_size; c++) neu1e[c] += g * out_params->syn1[c + l2];
     // Learn weights hidden -> output
@@ -769,6 +1666,7 @@ void ProcessSkipPair(long long in_word, long long out_word, unsigned long long *
     for (c = 0; c < layer1_size; c++) neu1e[c] += g * out_params->syn1neg[c + l2];
     for (c = 0; c < layer1_size; c++) out_params->syn1neg[c + l2] += g * in_params->syn0[c + l1];
   }
+  if (in_params->frozen != NULL && in_params->frozen[in_word]) return; // -freeze: the input row stays as loaded
   // Learn weights input -> hidden
   //TODO remove, index should be 'c'
   for (c = 0; c < layer1_size; c++) in_params->syn0[c + l1] += neu1e[c];
@@ -782,7 +1680,7 @@ void ProcessSkipPair(long long in_word, long long out_word, unsigned long long *
 // syn0: input embeddings (both hs and negative)
 // syn1: output embeddings (hs)
 // syn1neg: output embeddings (negative)
-void ProcessSentence(int sentence_length, long long *sen, struct lang_params *src, unsigned long long *next_random, real *neu1, real *neu1e) {
+void ProcessSentence(int sentence_length, long long *sen, struct lang_params *src, unsigned long long *next_random, real *neu1, real *neu1e, real sen_alpha) {
   int a, b, c, sentence_position;
   long long out_word, in_word;
 
@@ -804,7 +1702,7 @@ void ProcessSentence(int sentence_length, long long *sen, struct lang_params *sr
         in_word = sen[c];
         if (in_word == -1) continue;
 
-        ProcessSkipPair(in_word, out_word, next_random, src, src, neu1e, alpha);
+        ProcessSkipPair(in_word, out_word, next_random, src, src, neu1e, sen_alpha);
       } // for a (skipgram)
     } // end if cbow
   } // sentence
@@ -813,7 +1711,7 @@ void ProcessSentence(int sentence_length, long long *sen, struct lang_params *sr
 /** Crosslingual predictions **/
 void ProcessSentenceAlign(struct lang_params *src, long long src_word, int src_pos, //int *tgt_id_map,
                           struct lang_params *tgt, long long* tgt_sent, int tgt_len, int tgt_pos,
-                          unsigned long long *next_random, real *neu1, real *neu1e) {
+                          unsigned long long *next_random, real *neu1, real *neu1e, real align_alpha) {
   int neighbor_pos, a;
   //int neighbor_pos, neighbor_count;
   real b;
@@ -824,7 +1722,7 @@ void ProcessSentenceAlign(struct lang_params *src, long long src_word, int src_p
 
 #ifdef DEBUG
   long long tgt_word = tgt_sent[tgt_pos];
-  printf(" align %s (%d) - %s (%d)\n", src->vocab[src_word].word, src_pos, tgt->vocab[tgt_word].word, tgt_pos);
+  printf(" align %s (%d) - %s (%d)\n", GetVocabWord(src, src_word), src_pos, GetVocabWord(tgt, tgt_word), tgt_pos);
   fflush(stdout);
 #endif
 
@@ -837,416 +1735,685 @@ void ProcessSentenceAlign(struct lang_params *src, long long src_word, int src_p
       // src -> tgt neighbor
       neighbor_pos = tgt_pos -window + a;
       if (neighbor_pos >= 0 && neighbor_pos < tgt_len) {
-        ProcessSkipPair(src_word, tgt_sent[neighbor_pos], next_random, src, tgt, neu1e, bi_alpha);
+        ProcessSkipPair(src_word, tgt_sent[neighbor_pos], next_random, src, tgt, neu1e, align_alpha);
       }
     }
   } // end for if (cbow)
 }
 
 
-void *TrainModelThread(void *id) {
-#ifdef DEBUG
-  long long src_sen_orig[MAX_WORD_PER_SENT + 1], tgt_sen_orig[MAX_WORD_PER_SENT + 1];
-#endif
-  puts("Start TrainModelThread");
-  long long word;
-  int src_sentence_length = 0;
-  int tgt_sentence_length = 0;
-  long long src_sen[MAX_WORD_PER_SENT + 1];
-  long long tgt_sen[MAX_WORD_PER_SENT + 1];
-  unsigned long long next_random = (long long)id;
-  clock_t now;
-
-  //possibly replaceable by per-filepair arrays
-  long long src_word_count = 0, src_last_word_count = 0, tgt_word_count = 0;
-  FILE *src_fi = NULL, *tgt_fi = NULL, *align_fi=NULL;
-  long long int sent_id = 0;
-  //
-  
-  struct file_params *src_train;
-  struct file_params *tgt_train;
-
-  struct lang_params *src_lang;
-  struct lang_params *tgt_lang;
-
-  //index current pair in global list of file pairs
-  int finished_pairs = 0;
-  int current_pair = 0;
-
-  //check at the beginning of every file switch, only loop over files where you haven't finished this thread's block
-  int finished[num_pairs];
+// Where a reader takes the words of one thread block from: the file, while possibly recording it into
+// corpus, or corpus alone once a previous iteration has recorded all of it
+struct word_source {
+  FILE *fi;
+  char *file_name;
+  struct block_corpus *corpus;
+  long long pos;
+  int eof;
+};
 
-  //sent_ids - optional, seem to be only a debugging/printing thing, could be universal rather than file-pair specific
+void OpenWordSource(struct word_source *ws, struct file_params *train, long long id) {
+  ws->corpus = corpus_memory > 0 ? &train->blocks[id] : NULL;
+  ws->pos = 0;
+  ws->eof = 0;
+  ws->fi = NULL;
+  ws->file_name = train->train_file;
+  if (ws->corpus != NULL && ws->corpus->state == CORPUS_MEMORY) return;
+  ws->fi = OpenInputFile(train->train_file);
+  if (!stream_mode) SeekInputFile(ws->fi, train->train_file, train->line_blocks[id]);
+}
 
-  //to keep track of progress through each file (pair)
-  long long src_word_counts[num_pairs];
-  long long tgt_word_counts[num_pairs];
-  long long src_last_word_counts[num_pairs];
+// Closing a source ends its recording, which later iterations then read from
+void CloseWordSource(struct word_source *ws) {
+  struct block_corpus *corpus = ws->corpus;
+  if (ws->fi != NULL) CloseInputFile(ws->fi, ws->file_name);
+  if (corpus != NULL && corpus->state == CORPUS_RECORD) {
+    corpus->ids = (int *)realloc(corpus->ids, (corpus->size + 1) * sizeof(int));
+    __sync_fetch_and_add(&corpus_memory_used, (corpus->size + 1 - corpus->max_size) * (long long)sizeof(int));
+    corpus->max_size = corpus->size + 1;
+    corpus->state = CORPUS_MEMORY;
+  }
+}
 
-  //pointers to open files
-  FILE *src_fps[num_pairs], *tgt_fps[num_pairs], *align_fps[num_pairs];
+// Appends word to a recording; a block that would exceed -corpus-memory is dropped and stays on disk
+void RecordWordIndex(struct block_corpus *corpus, int word) {
+  long long grow;
+  if (corpus->size == corpus->max_size) {
+    grow = corpus->max_size > 0 ? corpus->max_size : 65536;
+    if (__sync_add_and_fetch(&corpus_memory_used, grow * (long long)sizeof(int)) > corpus_memory) {
+      __sync_fetch_and_sub(&corpus_memory_used, (grow + corpus->max_size) * (long long)sizeof(int));
+      free(corpus->ids);
+      corpus->ids = NULL;
+      corpus->size = corpus->max_size = 0;
+      corpus->state = CORPUS_DISK;
+      return;
+    }
+    corpus->max_size += grow;
+    corpus->ids = (int *)realloc(corpus->ids, corpus->max_size * sizeof(int));
+  }
+  corpus->ids[corpus->size++] = word;
+}
 
-  //have to replace all references to point at these arrays
-  //create global structure to track file pair set
-  //loop over file pairs
-  //alter EOF behavior from breaking out of thread to continuing on to next file pair and setting this one to "finished"
-  //
+void ReportCorpusMemory() {
+  int p, side, b, in_memory = 0, num_blocks = stream_mode ? 1 : num_threads;
+  struct file_params *train;
+  for (p = 0; p < num_pairs; p++) for (side = 0; side < 2; side++) {
+    train = side ? all_pairs[p]->tgt : all_pairs[p]->src;
+    for (b = 0; b < num_blocks; b++) if (train->blocks[b].state == CORPUS_MEMORY) in_memory++;
+  }
+  printf("# In-memory corpus: %d of %d blocks, %.1f MB\n", in_memory, 2 * num_pairs * num_blocks,
+         corpus_memory_used / 1048576.0);
+}
 
-  // for alignment
-  int src_sentence_orig_length=0, tgt_sentence_orig_length=0;
-  int src_id_map[MAX_WORD_PER_SENT + 1], tgt_id_map[MAX_WORD_PER_SENT + 1]; // map from original indices to new indices if id_map[j]==0, word j is deleted
-  int src_align_map[MAX_WORD_PER_SENT + 1]; // map from src positions to tgt positions and vice versa
-  int count; //for unsupervised alignment gaps
-  int src_pos, tgt_pos;
-  char ch;
+int NextWordIndex(struct word_source *ws, const struct lang_params *lang) {
+  int word;
+  if (ws->fi == NULL) {
+    if (ws->pos >= ws->corpus->size) {
+      ws->eof = 1;
+      return -1;
+    }
+    return ws->corpus->ids[ws->pos++];
+  }
+  word = ReadWordIndex(ws->fi, lang);
+  if (feof(ws->fi)) ws->eof = 1;
+  else if (ws->corpus != NULL && ws->corpus->state == CORPUS_RECORD) RecordWordIndex(ws->corpus, word);
+  return word;
+}
 
-  //temporary storage for a single word vector (layer1_size real numbers)
-  real *neu1 = (real *)calloc(layer1_size, sizeof(real)); // cbow
-  real *neu1e = (real *)calloc(layer1_size, sizeof(real)); // skipgram
+// A sentence pair read from one file pair and subsampled, ready for training
+struct sentence_pair {
+  int pair; // index in all_pairs
+  int src_length, tgt_length, src_orig_length, tgt_orig_length;
+  long long src_sen[MAX_WORD_PER_SENT + 1], tgt_sen[MAX_WORD_PER_SENT + 1];
+  // map from original indices to new indices; if id_map[j]==-1, word j is deleted
+  int src_id_map[MAX_WORD_PER_SENT + 1], tgt_id_map[MAX_WORD_PER_SENT + 1];
+  int src_align_map[MAX_WORD_PER_SENT + 1]; // map from src positions to tgt positions, -1 if unaligned
+  long long src_words, tgt_words; // in-vocab words read, counted against the thread's share
+  long long src_read, tgt_read; // tokens read, including unknown words and </s>
+};
 
-  long long all_tgt_words = 0; //debugging-related only
-  long long all_src_words = 0;
-  long long prev_all_src_words = 0;
-  long long total_all_tgt_words = 0;
-  long long total_all_src_words = 0;
+// Reading state of one thread block across all file pairs. Pairs are visited round-robin and each is
+// finished when its block is used up or its files end.
+struct pair_reader {
+  long long id; // block index
+  struct word_source *src_in, *tgt_in;
+  FILE **align_fps;
+  long long *src_word_counts, *tgt_word_counts;
+  int *finished;
+  int finished_pairs, current_pair;
+  long long sent_id;
+  unsigned long long next_random; // for subsampling
+  unsigned short *align_links; // (src_pos, tgt_pos) pairs of the current sentence
+};
 
-  //I'm fairly confident about the pointer juggling here but if something goes wrong look here first
-  for (current_pair=0; current_pair<num_pairs; current_pair++) {
-    pair = all_pairs[current_pair];
-    src_train = pair->src;
-    tgt_train = pair->tgt;
-
-    total_all_src_words = total_all_src_words + src_train->train_words;
-    total_all_tgt_words = total_all_tgt_words + tgt_train->train_words;
-    
-    src_fi = fopen(src_train->train_file, "rb");
-    fseek(src_fi, src_train->line_blocks[(long long)id], SEEK_SET);
-    src_fps[current_pair] = src_fi;
-    // tgt
-    tgt_fi = fopen(tgt_train->train_file, "rb");
-    fseek(tgt_fi, tgt_train->line_blocks[(long long)id], SEEK_SET);
-    tgt_fps[current_pair] = tgt_fi;
-    // align
-    if(align_opt){
-      align_fi = fopen(pair->align_file, "rb");
-      fseek(align_fi, pair->align_line_blocks[(long long)id], SEEK_SET);
-      tgt_fps[current_pair] = tgt_fi;
-    }
-    src_word_counts[current_pair] = 0;
-    src_last_word_counts[current_pair] = 0;
-    tgt_word_counts[current_pair] = 0;
-
-    finished[current_pair] = 0;
+void OpenPairReader(struct pair_reader *reader, long long id) {
+  int p;
+  struct pair_params *pp;
+  reader->id = id;
+  reader->src_in = (struct word_source *)calloc(num_pairs, sizeof(struct word_source));
+  reader->tgt_in = (struct word_source *)calloc(num_pairs, sizeof(struct word_source));
+  reader->align_fps = (FILE **)calloc(num_pairs, sizeof(FILE *));
+  reader->src_word_counts = (long long *)calloc(num_pairs, sizeof(long long));
+  reader->tgt_word_counts = (long long *)calloc(num_pairs, sizeof(long long));
+  reader->finished = (int *)calloc(num_pairs, sizeof(int));
+  reader->finished_pairs = 0;
+  reader->current_pair = 0;
+  reader->sent_id = 0;
+  reader->next_random = num_threads + id;
+  reader->align_links = NULL;
+  if (align_opt) reader->align_links = (unsigned short *)malloc(2 * MAX_ALIGN_LINKS * sizeof(unsigned short));
+  for (p = 0; p < num_pairs; p++) {
+    pp = all_pairs[p];
+    OpenWordSource(&reader->src_in[p], pp->src, id);
+    OpenWordSource(&reader->tgt_in[p], pp->tgt, id);
+    if (align_opt) {
+      reader->align_fps[p] = OpenInputFile(pp->align_file);
+      if (!stream_mode) SeekInputFile(reader->align_fps[p], pp->align_file, pp->align_line_blocks[id]);
+    }
   }
+}
 
-  printf("Total src words: %lld \n", total_all_src_words);
-  printf("Total tgt words: %lld \n", total_all_tgt_words);
-  
-  current_pair = 0;
-  while (finished_pairs < num_pairs) {
-    //within while loop, iterate over different src/tgt pairs? but would have to keep track of separate src/tgt_word_counts, sent_ids, last_word_counts, etc.
-    //and also different behavior when finishing a file block - don't drop entire thread, but continue with other file pairs?
-    current_pair = current_pair % num_pairs;
-    int loops = 0;
-    while (finished[current_pair] == 1) {
-      current_pair++;
-      if (current_pair >= num_pairs) {
-	current_pair = 0;
-	loops++;
-      }
-      if (loops > 3*num_pairs) {
-	printf("Stuck in infinite loop");
-	break;
-      }
-    }
+void ClosePairReader(struct pair_reader *reader) {
+  free(reader->src_in);
+  free(reader->tgt_in);
+  free(reader->align_fps);
+  free(reader->src_word_counts);
+  free(reader->tgt_word_counts);
+  free(reader->finished);
+  free(reader->align_links);
+}
 
+// Reads one sentence into sen, dropping unknown words and subsampling frequent ones
+void ReadSentence(struct word_source *ws, struct file_params *train, long long *sen, int *id_map, int *length, int *orig_length,
+                  long long *word_count, long long *read_count, unsigned long long *next_random) {
+  struct lang_params *lang = train->lang;
+  long long word;
 #ifdef DEBUG
-    printf("Continuing with current_pair %d (num_pairs %d) with languages %s, %s\n", current_pair, num_pairs, all_pairs[current_pair]->src->lang->lang_name, all_pairs[current_pair]->tgt->lang->lang_name);
+  long long sen_orig[MAX_WORD_PER_SENT + 1];
+  printf("  %s, sample=%g, dropping words:", lang->lang_name, sample); fflush(stdout);
 #endif
-    //switch to values for this pair
-    pair = all_pairs[current_pair];
-    src_word_count = src_word_counts[current_pair];
-    src_last_word_count = src_last_word_counts[current_pair];
-    tgt_word_count = tgt_word_counts[current_pair];
-    src_fi = src_fps[current_pair];
-    tgt_fi = tgt_fps[current_pair];
-    align_fi=align_fps[current_pair];
-  
-    src_train = pair->src;
-    tgt_train = pair->tgt;
-    src_lang = src_train->lang;
-    tgt_lang = tgt_train->lang;
 
+  *length = 0;
+  *orig_length = 0;
+  while (1) {
+    word = NextWordIndex(ws, lang);
+    (*read_count)++;
+    if (ws->eof || word == 0) break; // end of file or sentence
+    if (*orig_length >= MAX_WORD_PER_SENT) continue; // read enough
+
+    // keep the orig sentence
 #ifdef DEBUG
-    printf("# Load sentence %lld, src_word_count %lld, src_last_word_count %lld\n", sent_id, src_word_count, src_last_word_count); fflush(stdout);
-    printf("  src, sample=%g, dropping words:", sample); fflush(stdout);
+    if (word == -1) sen_orig[*orig_length] = lang->unk_id;
+    else sen_orig[*orig_length] = word;
 #endif
+    (*orig_length)++;
 
-    if (src_word_count > src_train->train_words) {
-      printf("BREAKPOINT: Out of source (swc/st->tw) words\n");
-    }
-    if (all_src_words > total_all_src_words) {
-      printf("BREAKPOINT: Out of source (all/total) words\n");
+    // unknown token. IMPORTANT: this line needs to be after the one where we store sen_orig (for bilingual models to work)
+    if (word == -1) {
+      id_map[*orig_length - 1] = -1;
+      continue;
     }
-
-    if (all_src_words - prev_all_src_words > 2000) {
-      src_train->word_count_actual += src_word_count - src_last_word_count;
-      prev_all_src_words = all_src_words;
-      src_last_word_count = src_word_count;
-      if ((debug_mode > 1)) {
-        now=clock();
-        printf("%cAlpha: %f, bi_alpha: %f,  Progress: %.2f%%  Words/thread/sec: %.2fk  ", 13, alpha, bi_alpha,
-	       //(src_train->word_count_actual)/ (real)(num_threads * src_train->train_words + 1) * 100,
-	       // src_train->word_count_actual / ((real)(now - start + 1) / (real)CLOCKS_PER_SEC * 1000));
-	       (all_src_words)/ (real)(num_threads * total_all_src_words + 1) * 100,
-	        all_src_words / ((real)(now - start + 1) / (real)CLOCKS_PER_SEC * 1000));
-        fflush(stdout);
+    (*word_count)++;
+
+    // The subsampling randomly discards frequent words while keeping the ranking same
+    if (sample > 0) {
+      // larger sample means larger ran, which means discard less frequent
+      // [ sqrt(freq) / sqrt(sample * N) + 1 ] * (sample * N / freq) = sqrt(sample * N / freq) + (sample * N / freq)
+      real ran = (sqrt(lang->vocab_cn[word] / (sample * train->train_words)) + 1) * (sample * train->train_words) / lang->vocab_cn[word];
+      *next_random = *next_random * (unsigned long long)25214903917 + 11;
+      if (ran < (*next_random & 0xFFFF) / (real)65536) { // discard
+        id_map[*orig_length - 1] = -1;
+        continue;
       }
-
-      alpha = starting_alpha * (1 - (cur_iter * src_train->train_words + src_train->word_count_actual) / (real)(num_train_iters * src_train->train_words + 1));
-      if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
-      bi_alpha = alpha*bi_weight;
     }
+    id_map[*orig_length - 1] = *length;
+    sen[*length] = word;
+    (*length)++;
+  }
 
-    // load src sentence
-    src_sentence_length = 0;
-    src_sentence_orig_length = 0;
-    while (1) {
-      word = ReadWordIndex(src_fi, src_lang->vocab, src_lang->vocab_hash);
-      all_src_words++;
-      if (feof(src_fi) || word == 0) break; // end of file or sentence
-      if(src_sentence_orig_length>=MAX_WORD_PER_SENT) continue; // read enough
+#ifdef DEBUG
+  sprintf(prefix, "\n  %s orig, len %d:", lang->lang_name, *orig_length);
+  print_sent(sen_orig, *orig_length, lang, prefix);
+  sprintf(prefix, "  %s, len %d:", lang->lang_name, *length);
+  print_sent(sen, *length, lang, prefix);
+#endif
+}
 
-      // keep the orig src
+// Reads the next sentence pair of the reader's block into sp. Returns 0 once all pairs are finished.
+int ReadSentencePair(struct pair_reader *reader, struct sentence_pair *sp) {
+  int p, loops = 0, num_links, k, src_pos, tgt_pos;
+  struct pair_params *pp;
+  struct lang_params *src_lang, *tgt_lang;
+
+  if (reader->finished_pairs >= num_pairs) return 0;
+  p = reader->current_pair % num_pairs;
+  while (reader->finished[p] == 1) {
+    p++;
+    if (p >= num_pairs) {
+      p = 0;
+      loops++;
+    }
+    if (loops > 3*num_pairs) {
+      printf("Stuck in infinite loop");
+      return 0;
+    }
+  }
+  pp = all_pairs[p];
+  src_lang = pp->src->lang;
+  tgt_lang = pp->tgt->lang;
 #ifdef DEBUG
-      if (word==-1) src_sen_orig[src_sentence_orig_length] = src_lang->unk_id;
-      else src_sen_orig[src_sentence_orig_length] = word;
+  printf("# Load sentence %lld of pair %d (%s-%s), src_word_count %lld\n", reader->sent_id, p, src_lang->lang_name, tgt_lang->lang_name, reader->src_word_counts[p]);
+  fflush(stdout);
 #endif
-      src_sentence_orig_length++;
 
-      // unknown token. IMPORTANT: this line needs to be after the one where we store src_sen_orig (for bilingual models to work)
-      if (word == -1) {
-        src_id_map[src_sentence_orig_length-1] = -1;
-        continue;
-      }
-      src_word_count++;
+  sp->pair = p;
+  sp->src_words = sp->tgt_words = sp->src_read = sp->tgt_read = 0;
+  ReadSentence(&reader->src_in[p], pp->src, sp->src_sen, sp->src_id_map, &sp->src_length, &sp->src_orig_length,
+               &sp->src_words, &sp->src_read, &reader->next_random);
+  ReadSentence(&reader->tgt_in[p], pp->tgt, sp->tgt_sen, sp->tgt_id_map, &sp->tgt_length, &sp->tgt_orig_length,
+               &sp->tgt_words, &sp->tgt_read, &reader->next_random);
+  reader->src_word_counts[p] += sp->src_words;
+  reader->tgt_word_counts[p] += sp->tgt_words;
+
+  // align; the links are read even for an empty tgt sentence to keep align_fi in step
+  if (align_opt) {
+    if (pp->align_binary) num_links = ReadAlignLinksBinary(reader->align_fps[p], reader->align_links);
+    else num_links = ReadAlignLinksText(reader->align_fps[p], reader->align_links);
+    for (src_pos = 0; src_pos < sp->src_orig_length; ++src_pos) sp->src_align_map[src_pos] = -1;
+    for (k = 0; k < num_links; k++) { // links past either sentence end (e.g. truncated sentences) are ignored
+      src_pos = reader->align_links[2 * k];
+      tgt_pos = reader->align_links[2 * k + 1];
+      if (src_pos < sp->src_orig_length && tgt_pos < sp->tgt_orig_length) sp->src_align_map[src_pos] = tgt_pos;
+    }
+  }
+  reader->sent_id++;
 
-      // The subsampling randomly discards frequent words while keeping the ranking same
-      if (sample > 0) {
-        // larger sample means larger ran, which means discard less frequent
-        // [ sqrt(freq) / sqrt(sample * N) + 1 ] * (sample * N / freq) = sqrt(sample * N / freq) + (sample * N / freq)
-        real ran = (sqrt(src_lang->vocab[word].cn / (sample * src_train->train_words)) + 1) * (sample * src_train->train_words) / src_lang->vocab[word].cn;
-        next_random = next_random * (unsigned long long)25214903917 + 11;
-        if (ran < (next_random & 0xFFFF) / (real)65536) { // discard
+  if (reader->tgt_in[p].eof) {
+    printf("End of target file for file pair %d (%s-%s)\n", p, src_lang->lang_name, tgt_lang->lang_name);
+    reader->finished[p] = 1;
+  }
+  if (!stream_mode && reader->tgt_word_counts[p] > pp->tgt->train_words / num_threads) {
+    printf("Exceeded target words per thread for file pair %d (%s-%s): %lld / %lld with %d threads\n", p, src_lang->lang_name, tgt_lang->lang_name, reader->tgt_word_counts[p], pp->tgt->train_words, num_threads);
+    reader->finished[p] = 1;
+  }
+  if (reader->src_in[p].eof) {
+    printf("End of source file for file pair %d (%s-%s)\n", p, src_lang->lang_name, tgt_lang->lang_name);
+    reader->finished[p] = 1;
+  }
+  if (!stream_mode && reader->src_word_counts[p] > pp->src->train_words / num_threads) {
+    printf("Exceeded source words per thread for file pair %d (%s-%s): %lld / %lld with %d threads\n", p, src_lang->lang_name, tgt_lang->lang_name, reader->src_word_counts[p], pp->src->train_words, num_threads);
+    reader->finished[p] = 1;
+  }
+  if (reader->finished[p]) {
+    CloseWordSource(&reader->src_in[p]); CloseWordSource(&reader->tgt_in[p]); if (align_opt) CloseInputFile(reader->align_fps[p], pp->align_file);
+    reader->finished_pairs++;
+  }
+  reader->current_pair = p + 1;
+  return 1;
+}
 
-#ifdef DEBUG
-          //printf("dropped: %s\n", src_lang->vocab[word].word);
-#endif
+// Monolingual updates for both sides of sp, then the crosslingual ones
+void TrainSentencePair(struct sentence_pair *sp, unsigned long long *next_random, real *neu1, real *neu1e, real sen_alpha) {
+  struct lang_params *src_lang = all_pairs[sp->pair]->src->lang;
+  struct lang_params *tgt_lang = all_pairs[sp->pair]->tgt->lang;
+  int src_pos, tgt_pos, count;
+  int *src_id_map = sp->src_id_map, *tgt_id_map = sp->tgt_id_map, *src_align_map = sp->src_align_map;
+  real bi_alpha = sen_alpha * bi_weight;
 
-          src_id_map[src_sentence_orig_length-1] = -1;
-          continue;
-        } else {
+  ProcessSentence(sp->src_length, sp->src_sen, src_lang, next_random, neu1, neu1e, sen_alpha);
+  ProcessSentence(sp->tgt_length, sp->tgt_sen, tgt_lang, next_random, neu1, neu1e, sen_alpha);
+
+  // align
+  if (sp->tgt_length == 0) return; //tgt sentence is empty
+  if (align_opt) { // use unsupervised alignments (UnsupAlign)
 #ifdef DEBUG
-          //printf("kept: %s\n", src_lang->vocab[word].word);
+    printf("Using unsupervised alignments.\n");
 #endif
-	  src_id_map[src_sentence_orig_length-1] = src_sentence_length;
+    for (src_pos = 0; src_pos < sp->src_orig_length; ++src_pos) {
+      if(src_id_map[src_pos]==-1) continue;
+
+      // get tgt_pos
+      if(src_align_map[src_pos]==-1){ // no alignment, try to infer
+        count = 0;
+        tgt_pos = 0;
+        if(src_pos>0 && src_align_map[src_pos-1]!=-1){ // previous link
+          tgt_pos += src_align_map[src_pos-1];
+          count++;
+        }
+        if(src_pos<(sp->src_orig_length-1) && src_align_map[src_pos+1]!=-1){ // next link
+          tgt_pos += src_align_map[src_pos+1];
+          count++;
         }
+        if (count>0) tgt_pos = tgt_pos / count;
+      } else {
+        tgt_pos = src_align_map[src_pos];
+        count = 1;
       }
 
-      src_sen[src_sentence_length] = word;
-      src_sentence_length++;
+      if (count>0 && tgt_id_map[tgt_pos]>=0){
+        // src, src_word, src_pos, tgt, tgt_sent, tgt_len, tgt_pos
+        ProcessSentenceAlign(src_lang, sp->src_sen[src_id_map[src_pos]], src_id_map[src_pos],
+                             tgt_lang, sp->tgt_sen, sp->tgt_length, tgt_id_map[tgt_pos],
+                             next_random, neu1, neu1e, bi_alpha);
+        ProcessSentenceAlign(tgt_lang, sp->tgt_sen[tgt_id_map[tgt_pos]], tgt_id_map[tgt_pos],
+                             src_lang, sp->src_sen, sp->src_length, src_id_map[src_pos],
+                             next_random, neu1, neu1e, bi_alpha);
+      }
     }
-
+  } else { // uniform alignments (MonoAlign)
 #ifdef DEBUG
-    sprintf(prefix, "\n  src orig %lld, len %d:", sent_id, src_sentence_orig_length);
-    print_sent(src_sen_orig, src_sentence_orig_length, src_lang->vocab, prefix);
-    sprintf(prefix, "  src %lld, len %d:", sent_id, src_sentence_length);
-    print_sent(src_sen, src_sentence_length, src_lang->vocab, prefix);
-    //printf("Press enter to continue:");
-    //getchar();
+    printf("Using uniform alignments.\n");
+    printf("src_sentence_length %d, src_sentence_orig_length %d, tgt_sentence_length %d, tgt_sentence_orig_length %d\n", sp->src_length, sp->src_orig_length, sp->tgt_length, sp->tgt_orig_length);
 #endif
+    for (src_pos = 0; src_pos < sp->src_orig_length; ++src_pos) {
+      tgt_pos = src_pos * sp->tgt_orig_length / sp->src_orig_length;
+      if(src_id_map[src_pos]>=0 && tgt_id_map[tgt_pos]>=0){
+        ProcessSentenceAlign(src_lang, sp->src_sen[src_id_map[src_pos]], src_id_map[src_pos],
+                             tgt_lang, sp->tgt_sen, sp->tgt_length, tgt_id_map[tgt_pos],
+                             next_random, neu1, neu1e, bi_alpha);
+        ProcessSentenceAlign(tgt_lang, sp->tgt_sen[tgt_id_map[tgt_pos]], tgt_id_map[tgt_pos],
+                             src_lang, sp->src_sen, sp->src_length, src_id_map[src_pos],
+                             next_random, neu1, neu1e, bi_alpha);
+      }
+    }
+  }
+}
 
-    ProcessSentence(src_sentence_length, src_sen, src_lang, &next_random, neu1, neu1e);
-    
-    // load tgt sentence
-    tgt_sentence_length = 0;
-    tgt_sentence_orig_length = 0;
-#ifdef DEBUG
-    printf("  tgt, sample=%g, dropping words:", sample); fflush(stdout);
-#endif
-    while (1) {
+// Bounded queue of sentence batches, shared by one reader thread and the compute threads it feeds
+struct sentence_batch {
+  int size;
+  struct sentence_pair *pairs;
+};
 
-      word = ReadWordIndex(tgt_fi, tgt_lang->vocab, tgt_lang->vocab_hash);
-      all_tgt_words++;
-      if (feof(tgt_fi) || word == 0) break; // end of file or sentence
-      if(tgt_sentence_orig_length>=MAX_WORD_PER_SENT) continue; // read enough
+struct batch_queue {
+  struct sentence_batch **items;
+  int capacity, head, count, closed;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+};
 
-      // keep the orig tgt
-#ifdef DEBUG
-      if (word==-1) tgt_sen_orig[tgt_sentence_orig_length] = tgt_lang->unk_id;
-      else tgt_sen_orig[tgt_sentence_orig_length] = word;
-#endif
-      tgt_sentence_orig_length++;
+void BatchQueueInit(struct batch_queue *q, int capacity) {
+  q->items = (struct sentence_batch **)malloc(capacity * sizeof(struct sentence_batch *));
+  q->capacity = capacity;
+  q->head = q->count = q->closed = 0;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->changed, NULL);
+}
 
-      // unknown token. IMPORTANT: this line needs to be after the one where we store sen_orig for bilingual models to work
-      if (word == -1) {
-        tgt_id_map[tgt_sentence_orig_length-1] = -1;
-        continue;
-      }
-      tgt_word_count++;
+void BatchQueueFree(struct batch_queue *q) {
+  free(q->items);
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->changed);
+}
 
-      // The subsampling randomly discards frequent words while keeping the ranking same
-      if (sample > 0) {
-        real ran = (sqrt(tgt_lang->vocab[word].cn / (sample * tgt_train->train_words)) + 1) * (sample * tgt_train->train_words) / tgt_lang->vocab[word].cn;
-        next_random = next_random * (unsigned long long)25214903917 + 11;
-        if (ran < (next_random & 0xFFFF) / (real)65536) {
+void BatchQueuePush(struct batch_queue *q, struct sentence_batch *batch) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == q->capacity) pthread_cond_wait(&q->changed, &q->lock);
+  q->items[(q->head + q->count) % q->capacity] = batch;
+  q->count++;
+  pthread_cond_broadcast(&q->changed);
+  pthread_mutex_unlock(&q->lock);
+}
 
-#ifdef DEBUG
-          //printf("dropped: %s\n", tgt_lang->vocab[word].word); fflush(stdout);
-#endif
+// Blocks until a batch is available; returns NULL once the queue is closed and drained
+struct sentence_batch *BatchQueuePop(struct batch_queue *q) {
+  struct sentence_batch *batch = NULL;
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0 && !q->closed) pthread_cond_wait(&q->changed, &q->lock);
+  if (q->count > 0) {
+    batch = q->items[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    pthread_cond_broadcast(&q->changed);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return batch;
+}
 
-          tgt_id_map[tgt_sentence_orig_length-1] = -1;
-          continue;
-        } else {
-#ifdef DEBUG
-          //printf("kept: %s\n", tgt_lang->vocab[word].word); fflush(stdout);
-#endif
-	  tgt_id_map[tgt_sentence_orig_length-1] = tgt_sentence_length;
-        }
-      }
-      tgt_sen[tgt_sentence_length] = word;
-      tgt_sentence_length++;
+void BatchQueueClose(struct batch_queue *q) {
+  pthread_mutex_lock(&q->lock);
+  q->closed = 1;
+  pthread_cond_broadcast(&q->changed);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// With -reader-threads, reader r parses the blocks of compute threads r, r + reader_threads, ... and
+// hands batches to them through ready_queues[r]; emptied batches come back through free_queues[r]
+struct batch_queue *ready_queues, *free_queues;
+
+// Each reader gets two batches per compute thread it feeds, so that one can be filled while the other is trained on
+void InitBatchQueues() {
+  int r, b, num_batches;
+  struct sentence_batch *batch;
+  ready_queues = (struct batch_queue *)malloc(reader_threads * sizeof(struct batch_queue));
+  free_queues = (struct batch_queue *)malloc(reader_threads * sizeof(struct batch_queue));
+  for (r = 0; r < reader_threads; r++) {
+    num_batches = 2 * ((num_threads - r - 1) / reader_threads + 1);
+    BatchQueueInit(&ready_queues[r], num_batches);
+    BatchQueueInit(&free_queues[r], num_batches);
+    for (b = 0; b < num_batches; b++) {
+      batch = (struct sentence_batch *)malloc(sizeof(struct sentence_batch));
+      batch->size = 0;
+      batch->pairs = (struct sentence_pair *)malloc(PREFETCH_BATCH * sizeof(struct sentence_pair));
+      BatchQueuePush(&free_queues[r], batch);
     }
+  }
+}
 
-#ifdef DEBUG 
-    sprintf(prefix, "\n  tgt orig %lld, len %d:", sent_id, tgt_sentence_orig_length);
-    print_sent(tgt_sen_orig, tgt_sentence_orig_length, tgt_lang->vocab, prefix);
-    sprintf(prefix, "  tgt %lld, len %d:", sent_id, tgt_sentence_length);
-    print_sent(tgt_sen, tgt_sentence_length, tgt_lang->vocab, prefix);
-    //printf("Press enter to continue:");
-    //getchar();
-#endif
-    
-    ProcessSentence(tgt_sentence_length, tgt_sen, tgt_lang, &next_random, neu1, neu1e);
-    
-    // align
-    if (tgt_sentence_length) { //tgt sentence is not empty
-      if (align_opt) { // use unsupervised alignments (UnsupAlign)
-#ifdef DEBUG
-	printf("Using unsupervised alignments.\n");
-#endif
-	for (src_pos = 0; src_pos < src_sentence_orig_length; ++src_pos) src_align_map[src_pos] = -1;
-
-	while (fscanf(align_fi, "%d %d%c", &src_pos, &tgt_pos, &ch)) {
-	  src_align_map[src_pos] = tgt_pos;
-	  if (ch == '\n') break;
-	}
-	
-	for (src_pos = 0; src_pos < src_sentence_orig_length; ++src_pos) {
-	  if(src_id_map[src_pos]==-1) continue;
-	  
-	  // get tgt_pos
-	  if(src_align_map[src_pos]==-1){ // no alignment, try to infer
-	    count = 0;
-	    tgt_pos = 0;
-	    if(src_pos>0 && src_align_map[src_pos-1]!=-1){ // previous link
-	      tgt_pos += src_align_map[src_pos-1];
-	      count++;
-	    }
-	    if(src_pos<(src_sentence_orig_length-1) && src_align_map[src_pos+1]!=-1){ // next link
-	      tgt_pos += src_align_map[src_pos+1];
-	      count++;
-	    }
-	    if (count>0) tgt_pos = tgt_pos / count;
-	  } else {
-	    tgt_pos = src_align_map[src_pos];
-	    count = 1;
-	  }
-	  
-	  if (count>0 && tgt_id_map[tgt_pos]>=0){
-	    // src, src_word, src_pos, tgt, tgt_sent, tgt_len, tgt_pos
-	    ProcessSentenceAlign(src_lang, src_sen[src_id_map[src_pos]], src_id_map[src_pos],
-				 tgt_lang, tgt_sen, tgt_sentence_length, tgt_id_map[tgt_pos],
-				 &next_random, neu1, neu1e);
-	    ProcessSentenceAlign(tgt_lang, tgt_sen[tgt_id_map[tgt_pos]], tgt_id_map[tgt_pos],
-				 src_lang, src_sen, src_sentence_length, src_id_map[src_pos],
-				 &next_random, neu1, neu1e);
-	  }
-	}
-      } else { // uniform alignments (MonoAlign)
-#ifdef DEBUG
-	printf("Using uniform alignments.\n");
-	printf("src_sentence_length %d, src_sentence_orig_length %d, tgt_sentence_length %d, tgt_sentence_orig_length %d\n", src_sentence_length, src_sentence_orig_length, tgt_sentence_length, tgt_sentence_orig_length);
-	int sl = 0;
-	for(sl=0; sl<src_sentence_orig_length; sl++) {
-	  printf(" %d", src_id_map[sl]);
-	}
-	printf("\n");
-	
-	for(sl=0; sl<tgt_sentence_orig_length; sl++) {
-	  printf(" %d", tgt_id_map[sl]);
-	}
-	printf("\n");
-	//printf("Press enter to continue:");
-	//getchar();
-#endif
-	for (src_pos = 0; src_pos < src_sentence_orig_length; ++src_pos) {
-	  tgt_pos = src_pos * tgt_sentence_orig_length / src_sentence_orig_length;
-	  if(src_id_map[src_pos]>=0 && tgt_id_map[tgt_pos]>=0){
-	    ProcessSentenceAlign(src_lang, src_sen[src_id_map[src_pos]], src_id_map[src_pos],
-				 tgt_lang, tgt_sen, tgt_sentence_length, tgt_id_map[tgt_pos],
-				 &next_random, neu1, neu1e);
-	    ProcessSentenceAlign(tgt_lang, tgt_sen[tgt_id_map[tgt_pos]], tgt_id_map[tgt_pos],
-				 src_lang, src_sen, src_sentence_length, src_id_map[src_pos],
-				 &next_random, neu1, neu1e);
-	  }
-	}
+void *ReaderThread(void *id) {
+  long long r = (long long)id, b;
+  int num_readers = 0, active, k;
+  struct pair_reader *readers = (struct pair_reader *)malloc(num_threads * sizeof(struct pair_reader));
+  struct sentence_batch *batch;
+
+  // in stream mode the only reader is the dispatcher, reading every file whole
+  for (b = r; b < (stream_mode ? 1 : num_threads); b += reader_threads) OpenPairReader(&readers[num_readers++], b);
+  active = num_readers;
+  k = 0;
+  while (active > 0) {
+    batch = BatchQueuePop(&free_queues[r]);
+    batch->size = 0;
+    // interleave the blocks so that all of them advance at the same pace
+    while (batch->size < PREFETCH_BATCH && active > 0) {
+      if (readers[k].finished_pairs < num_pairs) {
+        if (ReadSentencePair(&readers[k], &batch->pairs[batch->size])) batch->size++;
+        if (readers[k].finished_pairs >= num_pairs) active--;
       }
+      k = (k + 1) % num_readers;
     }
+    BatchQueuePush(&ready_queues[r], batch);
+  }
+  for (k = 0; k < num_readers; k++) ClosePairReader(&readers[k]);
+  free(readers);
+  BatchQueueClose(&ready_queues[r]);
+  pthread_exit(NULL);
+}
 
-#ifdef DEBUG
-    if ((sent_id % 1000) == 0) printf("Done processing sentence pair %lld\n", sent_id);
-#endif
+// Learning rate once word_count words of the current iteration have been trained on; it decays linearly
+// over all iterations of all pairs
+real AlphaAt(long long word_count) {
+  real a = starting_alpha * (1 - (cur_iter * train_words_total + word_count) / (real)(num_train_iters * train_words_total + 1));
+  if (a < starting_alpha * 0.0001) a = starting_alpha * 0.0001;
+  return a;
+}
 
-    sent_id++;
+// Mid-iteration checkpoints (-checkpoint-interval, SIGUSR1, SIGTERM): the main thread sets
+// quiesce_requested, every training thread records where it is at its next sentence boundary and
+// waits, the checkpoint is written with those records, and training goes on. Threads that are done
+// with their block record that too. This needs each thread to read its own block from plain files
+// (no -reader-threads, -corpus-memory, pipes or compressed files), so that file offsets say where
+// it is.
+struct thread_checkpoint {
+  int done, finished_pairs, current_pair;
+  long long sent_id, local_words, thread_words;
+  unsigned long long next_random, reader_random;
+  double thread_alpha;
+};
+struct pair_checkpoint {
+  long long src_offset, tgt_offset, align_offset, src_word_count, tgt_word_count;
+  int finished, src_eof, tgt_eof;
+};
+int checkpoint_interval = 0; // seconds between mid-iteration checkpoints, 0 = none
+int mid_checkpoints = 0; // whether this run can checkpoint mid-iteration
+volatile sig_atomic_t checkpoint_signal = 0; // SIGUSR1 or SIGTERM once received
+int quiesce_requested = 0, threads_paused = 0, threads_running = 0;
+pthread_mutex_t quiesce_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t quiesce_cond = PTHREAD_COND_INITIALIZER;
+struct thread_checkpoint *thread_checkpoints; // [num_threads]
+struct pair_checkpoint *pair_checkpoints; // [num_threads][num_pairs]
+int resume_mid_iter = 0; // the first iteration continues from the records above
+
+void RecordThreadState(long long id, struct pair_reader *reader, unsigned long long next_random, long long local_words,
+                       long long thread_words, real thread_alpha, int done) {
+  struct thread_checkpoint *tc = &thread_checkpoints[id];
+  struct pair_checkpoint *pc;
+  int p;
+  tc->done = done;
+  tc->finished_pairs = reader->finished_pairs;
+  tc->current_pair = reader->current_pair;
+  tc->sent_id = reader->sent_id;
+  tc->local_words = local_words;
+  tc->thread_words = thread_words;
+  tc->next_random = next_random;
+  tc->reader_random = reader->next_random;
+  tc->thread_alpha = thread_alpha;
+  for (p = 0; p < num_pairs; p++) {
+    pc = &pair_checkpoints[id * num_pairs + p];
+    pc->finished = reader->finished[p];
+    pc->src_word_count = reader->src_word_counts[p];
+    pc->tgt_word_count = reader->tgt_word_counts[p];
+    pc->src_eof = reader->src_in[p].eof;
+    pc->tgt_eof = reader->tgt_in[p].eof;
+    if (pc->finished) continue; // its files are closed
+    pc->src_offset = ftello(reader->src_in[p].fi);
+    pc->tgt_offset = ftello(reader->tgt_in[p].fi);
+    pc->align_offset = align_opt ? ftello(reader->align_fps[p]) : 0;
+  }
+}
+
+// Records the thread's state and waits until the checkpoint is written
+void PauseForCheckpoint(long long id, struct pair_reader *reader, unsigned long long next_random, long long local_words,
+                        long long thread_words, real thread_alpha) {
+  RecordThreadState(id, reader, next_random, local_words, thread_words, thread_alpha, 0);
+  pthread_mutex_lock(&quiesce_lock);
+  threads_paused++;
+  pthread_cond_broadcast(&quiesce_cond);
+  while (quiesce_requested) pthread_cond_wait(&quiesce_cond, &quiesce_lock);
+  threads_paused--;
+  pthread_mutex_unlock(&quiesce_lock);
+}
 
-    if (feof(tgt_fi)) {
-      printf("End of target file for file pair %d (%s-%s)\n", current_pair, src_lang->lang_name, tgt_lang->lang_name);
-      finished[current_pair] = 1;
+// Puts a freshly opened reader where the checkpointed one was
+void RestoreThreadState(long long id, struct pair_reader *reader, unsigned long long *next_random, long long *local_words,
+                        long long *thread_words, real *thread_alpha) {
+  struct thread_checkpoint *tc = &thread_checkpoints[id];
+  struct pair_checkpoint *pc;
+  int p;
+  reader->finished_pairs = tc->finished_pairs;
+  reader->current_pair = tc->current_pair;
+  reader->sent_id = tc->sent_id;
+  reader->next_random = tc->reader_random;
+  *local_words = tc->local_words;
+  *thread_words = tc->thread_words;
+  *next_random = tc->next_random;
+  *thread_alpha = tc->thread_alpha;
+  for (p = 0; p < num_pairs; p++) {
+    pc = &pair_checkpoints[id * num_pairs + p];
+    reader->finished[p] = pc->finished;
+    reader->src_word_counts[p] = pc->src_word_count;
+    reader->tgt_word_counts[p] = pc->tgt_word_count;
+    reader->src_in[p].eof = pc->src_eof;
+    reader->tgt_in[p].eof = pc->tgt_eof;
+    if (pc->finished) {
+      CloseWordSource(&reader->src_in[p]);
+      CloseWordSource(&reader->tgt_in[p]);
+      if (align_opt) CloseInputFile(reader->align_fps[p], all_pairs[p]->align_file);
+      continue;
     }
+    fseeko(reader->src_in[p].fi, pc->src_offset, SEEK_SET);
+    fseeko(reader->tgt_in[p].fi, pc->tgt_offset, SEEK_SET);
+    if (align_opt) fseeko(reader->align_fps[p], pc->align_offset, SEEK_SET);
+  }
+}
 
-    if (tgt_word_count > tgt_train->train_words / num_threads) {
-      printf("Exceeded target words per thread for file pair %d (%s-%s): %lld / %lld with %d threads\n", current_pair, src_lang->lang_name, tgt_lang->lang_name, tgt_word_count, tgt_train->train_words, num_threads);
-      finished[current_pair] = 1;
+void *TrainModelThread(void *id) {
+  puts("Start TrainModelThread");
+  unsigned long long next_random = (long long)id;
+  double thread_start = WallTime(), input_start;
+  struct thread_stats *ts = &thread_stats[(long long)id];
+  int j, k, got_input;
+  long long local_words = 0, thread_words = 0, done = 0;
+  real thread_alpha = AlphaAt(0);
+  struct pair_reader reader;
+  struct sentence_batch own_batch, *batch;
+  struct sentence_pair *sp;
+  struct batch_queue *ready_queue = NULL, *free_queue = NULL;
+  struct perf_group perf;
+  long long perf_last[NUM_PERF_EVENTS] = {0}, perf_now[NUM_PERF_EVENTS] = {0}, *counts; // a failed read keeps the old values
+  int perf_on = perf_counters && PerfOpen(&perf);
+
+  //temporary storage for a single word vector (layer1_size real numbers)
+  real *neu1 = (real *)calloc(layer1_size, sizeof(real)); // cbow
+  real *neu1e = (real *)calloc(layer1_size, sizeof(real)); // skipgram
+
+  long long all_tgt_words = 0; //debugging-related only
+  long long all_src_words = 0;
+  long long total_all_tgt_words = 0;
+  long long total_all_src_words = 0;
+
+  for (k = 0; k < num_pairs; k++) {
+    total_all_src_words = total_all_src_words + all_pairs[k]->src->train_words;
+    total_all_tgt_words = total_all_tgt_words + all_pairs[k]->tgt->train_words;
+  }
+
+  printf("Total src words: %lld \n", total_all_src_words);
+  printf("Total tgt words: %lld \n", total_all_tgt_words);
+
+  if (reader_threads > 0) { // batches come parsed from a reader thread
+    ready_queue = &ready_queues[(long long)id % reader_threads];
+    free_queue = &free_queues[(long long)id % reader_threads];
+  } else {
+    OpenPairReader(&reader, (long long)id);
+    own_batch.size = 1;
+    own_batch.pairs = (struct sentence_pair *)malloc(sizeof(struct sentence_pair));
+    if (resume_mid_iter) {
+      RestoreThreadState((long long)id, &reader, &next_random, &local_words, &thread_words, &thread_alpha);
+      if (thread_checkpoints[(long long)id].done) reader.finished_pairs = num_pairs;
     }
+  }
 
-    if (feof(src_fi)) {
-      printf("End of source file for file pair %d (%s-%s)\n", current_pair, src_lang->lang_name, tgt_lang->lang_name);
-      finished[current_pair] = 1;
+  ts->input_seconds = 0;
+  ts->sentence_pairs = 0;
+  while (1) {
+    if (mid_checkpoints && __atomic_load_n(&quiesce_requested, __ATOMIC_ACQUIRE)) {
+      PauseForCheckpoint((long long)id, &reader, next_random, local_words, thread_words, thread_alpha);
     }
-    
-    if (src_word_count > src_train->train_words / num_threads) {
-      printf("Exceeded source words per thread for file pair %d (%s-%s): %lld / %lld with %d threads\n", current_pair, src_lang->lang_name, tgt_lang->lang_name, src_word_count, src_train->train_words, num_threads);
-      finished[current_pair] = 1;
+    input_start = WallTime();
+    if (reader_threads > 0) {
+      batch = BatchQueuePop(ready_queue);
+      got_input = batch != NULL;
+    } else {
+      got_input = ReadSentencePair(&reader, own_batch.pairs);
+      batch = &own_batch;
     }
-
-    if (finished[current_pair]) {
-      fclose(src_fi); fclose(tgt_fi); if (align_opt) fclose(align_fi);
-      finished_pairs++;
-      continue;
+    ts->input_seconds += WallTime() - input_start;
+    if (!got_input) break;
+    ts->sentence_pairs += batch->size;
+    if (perf_on) PerfRead(&perf, perf_last);
+
+    for (k = 0; k < batch->size; k++) {
+      sp = &batch->pairs[k];
+      TrainSentencePair(sp, &next_random, neu1, neu1e, thread_alpha);
+      if (perf_on) {
+        PerfRead(&perf, perf_now);
+        counts = &perf_counts[((long long)id * num_pairs + sp->pair) * PERF_SLOTS];
+        for (j = 0; j < NUM_PERF_EVENTS; j++) {
+          counts[j] += perf_now[j] - perf_last[j];
+          perf_last[j] = perf_now[j];
+        }
+        counts[NUM_PERF_EVENTS] += sp->src_words + sp->tgt_words;
+      }
+      all_src_words += sp->src_read;
+      all_tgt_words += sp->tgt_read;
+      local_words += sp->src_read + sp->tgt_read; // tokens consumed, the unit of train_words
+
+      if (local_words >= PROGRESS_CHUNK) {
+        done = __atomic_add_fetch(&word_count_actual, local_words, __ATOMIC_RELAXED);
+        thread_words += local_words;
+        local_words = 0;
+        thread_alpha = AlphaAt(done);
+        if ((debug_mode > 1)) {
+          printf("%cAlpha: %f, bi_alpha: %f,  Progress: %.2f%%  Words/thread/sec: %.2fk  ", 13, thread_alpha, thread_alpha * bi_weight,
+                 done / (real)(train_words_total + 1) * 100,
+                 thread_words / ((WallTime() - start) * 1000));
+          fflush(stdout);
+        }
+      }
     }
 
-    //save values and switch to new file pair
-    src_word_counts[current_pair] = src_word_count;
-    src_last_word_counts[current_pair] = src_last_word_count;
-    tgt_word_counts[current_pair] = tgt_word_count;
-    //printf("Incrementing current_pair from %d to %d\n", current_pair, current_pair+1);
-    current_pair++;
-  } //end while(1)
+    if (reader_threads > 0) BatchQueuePush(free_queue, batch);
+  }
+
+  __atomic_add_fetch(&word_count_actual, local_words, __ATOMIC_RELAXED);
+  ts->words = thread_words + local_words;
+  ts->end = WallTime();
+  ts->seconds = ts->end - thread_start;
+  if (mid_checkpoints) {
+    RecordThreadState((long long)id, &reader, next_random, 0, thread_words + local_words, thread_alpha, 1);
+    pthread_mutex_lock(&quiesce_lock);
+    threads_running--;
+    pthread_cond_broadcast(&quiesce_cond);
+    pthread_mutex_unlock(&quiesce_lock);
+  }
 
+  if (reader_threads == 0) {
+    ClosePairReader(&reader);
+    free(own_batch.pairs);
+  }
+  if (perf_on) PerfClose(&perf);
   free(neu1);
   free(neu1e);
-  
+
   printf("Target words read: %lld/%lld \n", all_tgt_words, total_all_tgt_words);
   printf("Source words read: %lld/%lld \n", all_src_words, total_all_src_words);
   printf("End of thread\n");
@@ -1254,109 +2421,1172 @@ void *TrainModelThread(void *id) {
   pthread_exit(NULL);
 }
 
+// Binary vector file body: per word "<word> ", layer1_size raw floats and "\n". Rows are written
+// whole; with m2 each row is m1 + m2, summed into row first.
+void WriteBinaryRows(FILE *fo, struct lang_params *params, real *m1, real *m2, real *row, char *prefix) {
+  long long a, b;
+  char *word;
+  real *v;
+  for (a = 0; a < params->vocab_size; a++) {
+    word = GetVocabWord(params, a);
+    fputs(prefix, fo);
+    fwrite(word, 1, strlen(word), fo);
+    fputc(' ', fo);
+    v = &m1[a * layer1_size];
+    if (m2 != NULL) {
+      for (b = 0; b < layer1_size; b++) row[b] = v[b] + m2[a * layer1_size + b];
+      v = row;
+    }
+    fwrite(v, sizeof(real), layer1_size, fo);
+    fputc('\n', fo);
+  }
+}
+
+// Appends x and a space to p as "%.*f " with save_precision prints them and returns the new end.
+// A float times 10^12 or less is exact in a double, so rounding it to an integer with llrint (ties
+// to even) gives the same digits as printf; other values go through printf.
+char *FormatReal(char *p, real x) {
+  static const double scale[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12};
+  static const unsigned long long iscale[] = {1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+      10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL};
+  unsigned int bits;
+  unsigned long long n, ip, fp;
+  double m;
+  char digits[24];
+  int k = 0;
+  memcpy(&bits, &x, sizeof(bits));
+  m = fabs((double)x) * scale[save_precision];
+  // inf and nan (exponent all ones) are tested on the bits, since -Ofast assumes finite math
+  if ((bits & 0x7f800000) == 0x7f800000 || m >= 9e18) return p + sprintf(p, "%.*f ", save_precision, x);
+  n = (unsigned long long)llrint(m);
+  if (bits >> 31) *p++ = '-';
+  ip = n / iscale[save_precision];
+  fp = n % iscale[save_precision];
+  do {
+    digits[k++] = '0' + ip % 10;
+    ip /= 10;
+  } while (ip);
+  while (k) *p++ = digits[--k];
+  if (save_precision > 0) {
+    *p++ = '.';
+    for (k = save_precision - 1; k >= 0; k--) {
+      p[k] = '0' + fp % 10;
+      fp /= 10;
+    }
+    p += save_precision;
+  }
+  *p++ = ' ';
+  return p;
+}
+
+// Threads of the text writer and of product quantization: save_threads while a -save-async save runs
+// beside the training threads, num_threads otherwise
+int writer_threads = 1;
+
+// Text vector file body, formatted by writer_threads threads. Thread t formats chunks t,
+// t + writer_threads, ... of SAVE_CHUNK_ROWS rows into its own buffer and writes each one when its
+// turn comes.
+struct text_writer {
+  FILE *fo;
+  struct lang_params *params;
+  real *m1, *m2; // rows are m1, or m1 + m2
+  char *prefix; // written before every word
+  long long next_chunk; // next chunk to be written
+  pthread_mutex_t lock;
+  pthread_cond_t turn;
+};
+struct text_writer_arg {
+  struct text_writer *w;
+  long long id;
+};
+
+void *TextWriterThread(void *arg) {
+  struct text_writer *w = ((struct text_writer_arg *)arg)->w;
+  long long c, a, b, end, word_len, need, offset, prefix_len = strlen(w->prefix);
+  long long chunks = (w->params->vocab_size + SAVE_CHUNK_ROWS - 1) / SAVE_CHUNK_ROWS;
+  long long cap = SAVE_CHUNK_ROWS * (layer1_size * (save_precision + 5) + 32);
+  char *buf = (char *)malloc(cap), *p, *word;
+  real *v1, *v2;
+  for (c = ((struct text_writer_arg *)arg)->id; c < chunks; c += writer_threads) {
+    end = (c + 1) * SAVE_CHUNK_ROWS;
+    if (end > w->params->vocab_size) end = w->params->vocab_size;
+    p = buf;
+    for (a = c * SAVE_CHUNK_ROWS; a < end; a++) {
+      word = GetVocabWord(w->params, a);
+      word_len = strlen(word);
+      need = p - buf + prefix_len + word_len + 2 + layer1_size * 64; // a number takes at most 64 bytes
+      if (need > cap) {
+        offset = p - buf;
+        cap = need * 2;
+        buf = (char *)realloc(buf, cap);
+        p = buf + offset;
+      }
+      memcpy(p, w->prefix, prefix_len);
+      p += prefix_len;
+      memcpy(p, word, word_len);
+      p += word_len;
+      *p++ = ' ';
+      v1 = &w->m1[a * layer1_size];
+      v2 = w->m2 == NULL ? NULL : &w->m2[a * layer1_size];
+      for (b = 0; b < layer1_size; b++) p = FormatReal(p, v2 == NULL ? v1[b] : v1[b] + v2[b]);
+      *p++ = '\n';
+    }
+    pthread_mutex_lock(&w->lock);
+    while (w->next_chunk != c) pthread_cond_wait(&w->turn, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+    fwrite(buf, 1, p - buf, w->fo);
+    pthread_mutex_lock(&w->lock);
+    w->next_chunk++;
+    pthread_cond_broadcast(&w->turn);
+    pthread_mutex_unlock(&w->lock);
+  }
+  free(buf);
+  pthread_exit(NULL);
+}
+
+void WriteTextRows(FILE *fo, struct lang_params *params, real *m1, real *m2, char *prefix) {
+  pthread_t *pt = (pthread_t *)malloc(writer_threads * sizeof(pthread_t));
+  struct text_writer_arg *args = (struct text_writer_arg *)malloc(writer_threads * sizeof(struct text_writer_arg));
+  struct text_writer w;
+  long long t;
+  w.fo = fo;
+  w.params = params;
+  w.m1 = m1;
+  w.m2 = m2;
+  w.prefix = prefix;
+  w.next_chunk = 0;
+  pthread_mutex_init(&w.lock, NULL);
+  pthread_cond_init(&w.turn, NULL);
+  for (t = 0; t < writer_threads; t++) {
+    args[t].w = &w;
+    args[t].id = t;
+    pthread_create(&pt[t], NULL, TextWriterThread, &args[t]);
+  }
+  for (t = 0; t < writer_threads; t++) pthread_join(pt[t], NULL);
+  pthread_mutex_destroy(&w.lock);
+  pthread_cond_destroy(&w.turn);
+  free(args);
+  free(pt);
+}
+
+// Memory-mappable vector file (-binary 2), read in place by distance. All offsets are from the
+// start of the file:
+//   struct embedding_header
+//   float32 matrix [vocab_size][size] at matrix_offset, a multiple of 64
+//   long long offsets [vocab_size + 1] at offsets_offset: word a is strings + offsets[a], NUL-terminated
+//   the words at strings_offset
+//   int hash [hash_size] at hash_offset: word index or -1; a word starts probing at EmbeddingHash
+//   modulo hash_size and moves on by one slot
+#define EMBEDDING_MAGIC "MVEMB001"
+struct embedding_header {
+  char magic[8];
+  long long vocab_size, size;
+  long long matrix_offset, offsets_offset, strings_offset, hash_offset, hash_size, file_size;
+};
+
+unsigned long long EmbeddingHash(const char *word) {
+  unsigned long long hash = 0;
+  for (; *word; word++) hash = hash * 257 + (unsigned char)*word;
+  return hash;
+}
+
+// Places the word index (offsets, strings, hash) of params after the data, which ends at end
+void WordIndexLayout(struct lang_params *params, struct embedding_header *header, long long end, long long *offsets) {
+  long long a, v = params->vocab_size;
+  offsets[0] = 0;
+  for (a = 0; a < v; a++) offsets[a + 1] = offsets[a] + strlen(GetVocabWord(params, a)) + 1;
+  header->offsets_offset = (end + 7) / 8 * 8;
+  header->strings_offset = header->offsets_offset + (v + 1) * sizeof(long long);
+  header->hash_offset = (header->strings_offset + offsets[v] + 7) / 8 * 8;
+  header->hash_size = 2 * v + 1;
+  header->file_size = header->hash_offset + header->hash_size * sizeof(int);
+}
+
+// Writes the word index laid out by WordIndexLayout; the file is at end
+void WriteWordIndex(FILE *fo, struct lang_params *params, struct embedding_header *header, long long end, long long *offsets) {
+  long long a, h, v = params->vocab_size;
+  int *hash = (int *)malloc(header->hash_size * sizeof(int));
+  char *word, zeros[64] = {0};
+  for (h = 0; h < header->hash_size; h++) hash[h] = -1;
+  for (a = 0; a < v; a++) {
+    h = EmbeddingHash(GetVocabWord(params, a)) % header->hash_size;
+    while (hash[h] != -1) h = (h + 1) % header->hash_size;
+    hash[h] = a;
+  }
+  fwrite(zeros, 1, header->offsets_offset - end, fo);
+  fwrite(offsets, sizeof(long long), v + 1, fo);
+  for (a = 0; a < v; a++) {
+    word = GetVocabWord(params, a);
+    fwrite(word, 1, strlen(word) + 1, fo);
+  }
+  fwrite(zeros, 1, header->hash_offset - header->strings_offset - offsets[v], fo);
+  fwrite(hash, sizeof(int), header->hash_size, fo);
+  free(hash);
+}
+
+void WriteMappedVectors(FILE *fo, struct lang_params *params, real *m1, real *m2) {
+  struct embedding_header header;
+  long long a, b, v = params->vocab_size;
+  long long *offsets = (long long *)malloc((v + 1) * sizeof(long long));
+  float *row = (float *)malloc(layer1_size * sizeof(float));
+  char zeros[64] = {0};
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, EMBEDDING_MAGIC, 8);
+  header.vocab_size = v;
+  header.size = layer1_size;
+  header.matrix_offset = (sizeof(header) + 63) / 64 * 64;
+  WordIndexLayout(params, &header, header.matrix_offset + v * layer1_size * sizeof(float), offsets);
+
+  fwrite(&header, sizeof(header), 1, fo);
+  fwrite(zeros, 1, header.matrix_offset - sizeof(header), fo);
+  for (a = 0; a < v; a++) {
+    for (b = 0; b < layer1_size; b++) row[b] = m1[a * layer1_size + b] + (m2 == NULL ? 0 : m2[a * layer1_size + b]);
+    fwrite(row, sizeof(float), layer1_size, fo);
+  }
+  WriteWordIndex(fo, params, &header, header.matrix_offset + v * layer1_size * sizeof(float), offsets);
+  free(row);
+  free(offsets);
+}
+
+// Quantized vector files (-quantize), <vector file>.int8 or <vector file>.pq, memory-mappable like
+// -binary 2 and searched in place by distance. All offsets are from the start of the file:
+//   struct quantized_header; its words header has magic QUANTIZED_MAGIC, the codes at matrix_offset
+//   and the word index of -binary 2
+//   int8 (kind 1): float scales [vocab_size] at scales_offset and signed char codes [vocab_size][size];
+//     row a is scales[a] * codes[a]
+//   PQ (kind 2): float codebooks [subvectors][centroids][size / subvectors] at codebooks_offset and
+//     unsigned char codes [vocab_size][subvectors]; part m of row a is codebooks[m][codes[a][m]]
+#define QUANTIZED_MAGIC "MVQNT001"
+#define PQ_CENTROIDS 256
+#define PQ_ITERATIONS 20
+#define PQ_TRAIN_ROWS 65536 // rows sampled to train the codebooks
+struct quantized_header {
+  struct embedding_header words;
+  long long kind, subvectors, centroids, scales_offset, codebooks_offset;
+};
+int quantize = 0; // 1 int8, 2 product quantization, written by the save after the last iteration only
+int final_save = 1; // the save being written is the one after the last iteration
+int pq_subvectors = 0; // default size / 4
+
+struct pq_job {
+  long long id, v, k, dsub, n;
+  real *m1;
+  long long *sample; // rows the codebooks are trained on
+  float *codebooks;
+  unsigned char *codes;
+  double *error; // squared reconstruction error of each subvector
+};
+
+long long NearestCentroid(const real *x, const float *codebook, long long k, long long dsub) {
+  long long c, d, best = 0;
+  float dist, best_dist = 0;
+  for (c = 0; c < k; c++) {
+    dist = 0;
+    for (d = 0; d < dsub; d++) dist += (x[d] - codebook[c * dsub + d]) * (x[d] - codebook[c * dsub + d]);
+    if (c == 0 || dist < best_dist) {
+      best = c;
+      best_dist = dist;
+    }
+  }
+  return best;
+}
+
+// Trains the codebooks of subvectors id, id + writer_threads, ... with k-means and encodes every row
+void *PQThread(void *arg) {
+  struct pq_job *job = (struct pq_job *)arg;
+  long long m, it, i, c, d, k = job->k, dsub = job->dsub, subvectors = layer1_size / dsub;
+  unsigned long long next_random = job->id + 1;
+  float *sums = (float *)malloc(k * dsub * sizeof(float)), *codebook, *x;
+  long long *counts = (long long *)malloc(k * sizeof(long long));
+  for (m = job->id; m < subvectors; m += writer_threads) {
+    codebook = &job->codebooks[m * k * dsub];
+    for (c = 0; c < k; c++) for (d = 0; d < dsub; d++) {
+      codebook[c * dsub + d] = job->m1[job->sample[c * job->n / k] * layer1_size + m * dsub + d];
+    }
+    for (it = 0; it < PQ_ITERATIONS; it++) {
+      for (i = 0; i < k * dsub; i++) sums[i] = 0;
+      for (c = 0; c < k; c++) counts[c] = 0;
+      for (i = 0; i < job->n; i++) {
+        x = &job->m1[job->sample[i] * layer1_size + m * dsub];
+        c = NearestCentroid(x, codebook, k, dsub);
+        counts[c]++;
+        for (d = 0; d < dsub; d++) sums[c * dsub + d] += x[d];
+      }
+      for (c = 0; c < k; c++) {
+        if (counts[c] == 0) { // an empty cluster restarts at a random sampled row
+          next_random = next_random * (unsigned long long)25214903917 + 11;
+          x = &job->m1[job->sample[(next_random >> 16) % job->n] * layer1_size + m * dsub];
+          for (d = 0; d < dsub; d++) codebook[c * dsub + d] = x[d];
+        } else {
+          for (d = 0; d < dsub; d++) codebook[c * dsub + d] = sums[c * dsub + d] / counts[c];
+        }
+      }
+    }
+    job->error[m] = 0;
+    for (i = 0; i < job->v; i++) {
+      x = &job->m1[i * layer1_size + m * dsub];
+      c = NearestCentroid(x, codebook, k, dsub);
+      job->codes[i * subvectors + m] = c;
+      for (d = 0; d < dsub; d++) job->error[m] += (x[d] - codebook[c * dsub + d]) * (x[d] - codebook[c * dsub + d]);
+    }
+  }
+  free(sums);
+  free(counts);
+  pthread_exit(NULL);
+}
+
+void WriteQuantizedVectors(char *vector_file, struct lang_params *params, real *m1) {
+  struct quantized_header header;
+  char file_name[MAX_STRING + 8], *buf, zeros[64] = {0};
+  long long a, b, v = params->vocab_size, end, codes_size, *offsets;
+  long long subvectors = pq_subvectors, dsub = layer1_size / pq_subvectors;
+  unsigned long long next_random = 1;
+  signed char *codes;
+  float *scales = NULL, *codebooks = NULL, max;
+  double error = 0, total = 0, *errors;
+  pthread_t *pt;
+  struct pq_job *jobs;
+  FILE *fo;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.words.magic, QUANTIZED_MAGIC, 8);
+  header.words.vocab_size = v;
+  header.words.size = layer1_size;
+  header.kind = quantize;
+  if (quantize == 1) {
+    codes_size = v * layer1_size;
+    codes = (signed char *)malloc(codes_size);
+    scales = (float *)malloc(v * sizeof(float));
+    for (a = 0; a < v; a++) {
+      max = 0;
+      for (b = 0; b < layer1_size; b++) if (fabs(m1[a * layer1_size + b]) > max) max = fabs(m1[a * layer1_size + b]);
+      scales[a] = max / 127;
+      for (b = 0; b < layer1_size; b++) {
+        codes[a * layer1_size + b] = max == 0 ? 0 : lrintf(m1[a * layer1_size + b] / scales[a]);
+        error += (m1[a * layer1_size + b] - scales[a] * codes[a * layer1_size + b]) *
+                 (m1[a * layer1_size + b] - scales[a] * codes[a * layer1_size + b]);
+        total += m1[a * layer1_size + b] * m1[a * layer1_size + b];
+      }
+    }
+    header.scales_offset = (sizeof(header) + 63) / 64 * 64;
+    header.words.matrix_offset = (header.scales_offset + v * sizeof(float) + 63) / 64 * 64;
+  } else {
+    header.subvectors = subvectors;
+    header.centroids = v < PQ_CENTROIDS ? v : PQ_CENTROIDS;
+    codes_size = v * subvectors;
+    codes = (signed char *)malloc(codes_size);
+    codebooks = (float *)malloc(subvectors * header.centroids * dsub * sizeof(float));
+    errors = (double *)malloc(subvectors * sizeof(double));
+    pt = (pthread_t *)malloc(writer_threads * sizeof(pthread_t));
+    jobs = (struct pq_job *)malloc(writer_threads * sizeof(struct pq_job));
+    jobs[0].n = v < PQ_TRAIN_ROWS ? v : PQ_TRAIN_ROWS;
+    jobs[0].sample = (long long *)malloc(jobs[0].n * sizeof(long long));
+    for (a = 0; a < jobs[0].n; a++) {
+      next_random = next_random * (unsigned long long)25214903917 + 11;
+      jobs[0].sample[a] = jobs[0].n == v ? a : (long long)((next_random >> 16) % v);
+    }
+    for (a = 0; a < writer_threads; a++) {
+      jobs[a] = jobs[0];
+      jobs[a].id = a;
+      jobs[a].v = v;
+      jobs[a].k = header.centroids;
+      jobs[a].dsub = dsub;
+      jobs[a].m1 = m1;
+      jobs[a].codebooks = codebooks;
+      jobs[a].codes = (unsigned char *)codes;
+      jobs[a].error = errors;
+      pthread_create(&pt[a], NULL, PQThread, &jobs[a]);
+    }
+    for (a = 0; a < writer_threads; a++) pthread_join(pt[a], NULL);
+    for (a = 0; a < subvectors; a++) error += errors[a];
+    for (a = 0; a < v * layer1_size; a++) total += m1[a] * m1[a];
+    free(jobs[0].sample);
+    free(jobs);
+    free(pt);
+    free(errors);
+    header.codebooks_offset = (sizeof(header) + 63) / 64 * 64;
+    header.words.matrix_offset = header.codebooks_offset + subvectors * header.centroids * dsub * sizeof(float);
+    header.words.matrix_offset = (header.words.matrix_offset + 63) / 64 * 64;
+  }
+  end = header.words.matrix_offset + codes_size;
+  offsets = (long long *)malloc((v + 1) * sizeof(long long));
+  WordIndexLayout(params, &header.words, end, offsets);
+
+  sprintf(file_name, "%s.%s", vector_file, quantize == 1 ? "int8" : "pq");
+  fo = fopen(file_name, "wb");
+  if (fo == NULL) {
+    printf("ERROR: cannot write %s\n", file_name);
+    exit(1);
+  }
+  buf = (char *)malloc(SAVE_BUFFER);
+  setvbuf(fo, buf, _IOFBF, SAVE_BUFFER);
+  fwrite(&header, sizeof(header), 1, fo);
+  if (quantize == 1) {
+    fwrite(zeros, 1, header.scales_offset - sizeof(header), fo);
+    fwrite(scales, sizeof(float), v, fo);
+    fwrite(zeros, 1, header.words.matrix_offset - header.scales_offset - v * sizeof(float), fo);
+  } else {
+    fwrite(zeros, 1, header.codebooks_offset - sizeof(header), fo);
+    fwrite(codebooks, sizeof(float), subvectors * header.centroids * dsub, fo);
+    fwrite(zeros, 1, header.words.matrix_offset - header.codebooks_offset - subvectors * header.centroids * dsub * sizeof(float), fo);
+  }
+  fwrite(codes, 1, codes_size, fo);
+  WriteWordIndex(fo, params, &header.words, end, offsets);
+  fclose(fo);
+  printf("# %s: %lld bytes per vector, relative squared error %.3g\n", file_name, codes_size / (v > 0 ? v : 1) +
+         (quantize == 1 ? (long long)sizeof(float) : 0), total > 0 ? error / total : 0);
+  free(buf);
+  free(offsets);
+  free(codes);
+  free(scales);
+  free(codebooks);
+}
+
+// Writes one vector file in the -binary format; rows are m1, or m1 + m2
+void WriteVectorFile(char *file_name, struct lang_params *params, real *m1, real *m2) {
+  FILE *fo = fopen(file_name, "wb");
+  char *buf = (char *)malloc(SAVE_BUFFER);
+  real *row = NULL;
+  if (fo == NULL) {
+    printf("ERROR: cannot write %s\n", file_name);
+    exit(1);
+  }
+  setvbuf(fo, buf, _IOFBF, SAVE_BUFFER);
+  if (binary == 2) {
+    WriteMappedVectors(fo, params, m1, m2);
+  } else if (binary) {
+    fprintf(fo, "%lld %lld\n", params->vocab_size, layer1_size);
+    if (m2 != NULL) row = (real *)malloc(layer1_size * sizeof(real));
+    WriteBinaryRows(fo, params, m1, m2, row, "");
+    free(row);
+  } else {
+    fprintf(fo, "%lld %lld\n", params->vocab_size, layer1_size);
+    WriteTextRows(fo, params, m1, m2, "");
+  }
+  fclose(fo);
+  free(buf);
+}
+
+// NumPy export (-save-npy): <file>.npy holds a matrix as a float32 C-order [vocab_size][size] array
+// whose data starts at NPY_DATA_OFFSET, so np.load(mmap_mode='r') maps it page-aligned with no
+// parsing, and <file>.words lists the words in row order.
+#define NPY_DATA_OFFSET 4096
+int save_npy = 0;
+
+void WriteNpy(char *file_name, struct lang_params *params, real *m) {
+  char header[NPY_DATA_OFFSET], *buf;
+  int len, one = 1;
+  FILE *fo = fopen(file_name, "wb");
+  if (fo == NULL) {
+    printf("ERROR: cannot write %s\n", file_name);
+    exit(1);
+  }
+  buf = (char *)malloc(SAVE_BUFFER);
+  setvbuf(fo, buf, _IOFBF, SAVE_BUFFER);
+  // magic, version 1.0, little-endian header length, then the header dict padded with spaces and a newline
+  memset(header, ' ', NPY_DATA_OFFSET);
+  memcpy(header, "\x93NUMPY\x01\x00", 8);
+  header[8] = (NPY_DATA_OFFSET - 10) & 0xFF;
+  header[9] = (NPY_DATA_OFFSET - 10) >> 8;
+  len = sprintf(header + 10, "{'descr': '%cf%d', 'fortran_order': False, 'shape': (%lld, %lld), }",
+                *(char *)&one ? '<' : '>', (int)sizeof(real), params->vocab_size, layer1_size);
+  header[10 + len] = ' ';
+  header[NPY_DATA_OFFSET - 1] = '\n';
+  fwrite(header, 1, NPY_DATA_OFFSET, fo);
+  fwrite(m, sizeof(real), params->vocab_size * layer1_size, fo);
+  fclose(fo);
+  free(buf);
+}
+
+void WriteNpyWords(char *file_name, struct lang_params *params) {
+  char *buf = (char *)malloc(SAVE_BUFFER);
+  long long a;
+  FILE *fo = fopen(file_name, "wb");
+  if (fo == NULL) {
+    printf("ERROR: cannot write %s\n", file_name);
+    exit(1);
+  }
+  setvbuf(fo, buf, _IOFBF, SAVE_BUFFER);
+  for (a = 0; a < params->vocab_size; a++) {
+    fputs(GetVocabWord(params, a), fo);
+    fputc('\n', fo);
+  }
+  fclose(fo);
+  free(buf);
+}
+
 // opt 1: save avg vecs, 2: save out vecs
 void SaveVector(char* output_prefix, char* lang, struct lang_params *params, int opt){
-  long a, b;
-  long long vocab_size = params->vocab_size;
-  struct vocab_word *vocab = params->vocab;
-  real sum;
-  int save_out_vecs = 0, save_avg_vecs = 0;
-  if (opt==1) save_avg_vecs = 1;
-  if (opt==2) save_out_vecs = 1;
-
   char output_file[MAX_STRING];
   sprintf(output_file, "%s.%s", output_prefix, lang);
+  WriteVectorFile(output_file, params, params->syn0, NULL);
+  if (quantize && final_save) WriteQuantizedVectors(output_file, params, params->syn0);
+  if (save_npy) {
+    sprintf(output_file, "%s.%s.npy", output_prefix, lang);
+    WriteNpy(output_file, params, params->syn0);
+    sprintf(output_file, "%s.%s.words", output_prefix, lang);
+    WriteNpyWords(output_file, params);
+    if (negative > 0) {
+      sprintf(output_file, "%s.outvec.%s.npy", output_prefix, lang);
+      WriteNpy(output_file, params, params->syn1neg);
+    }
+  }
+  if (hs == 0) { // only for negative sampling, we have the notion of output vectors
+    if (opt == 1) { // sum of in and out vecs
+      sprintf(output_file, "%s.sumvec.%s", output_prefix, lang);
+      WriteVectorFile(output_file, params, params->syn0, params->syn1neg);
+    }
+    if (opt == 2) {
+      sprintf(output_file, "%s.outvec.%s", output_prefix, lang);
+      WriteVectorFile(output_file, params, params->syn1neg, NULL);
+    }
+  }
+}
+
+// All languages in the single file <output> (-save-merged), text or -binary 1, with a header that
+// counts every word and each word written as <lang>:<word>
+void SaveMerged(struct lang_params **langs) {
+  FILE *fo = fopen(output_prefix, "wb");
+  char *buf = (char *)malloc(SAVE_BUFFER), prefix[MAX_STRING + 1];
+  long long total = 0;
+  real *row = (real *)malloc(layer1_size * sizeof(real));
+  int ll;
+  if (fo == NULL) {
+    printf("ERROR: cannot write %s\n", output_prefix);
+    exit(1);
+  }
+  setvbuf(fo, buf, _IOFBF, SAVE_BUFFER);
+  for (ll = 0; ll < num_languages; ll++) total += langs[ll]->vocab_size;
+  fprintf(fo, "%lld %lld\n", total, layer1_size);
+  for (ll = 0; ll < num_languages; ll++) {
+    sprintf(prefix, "%s:", langs[ll]->lang_name);
+    if (binary) WriteBinaryRows(fo, langs[ll], langs[ll]->syn0, NULL, row, prefix);
+    else WriteTextRows(fo, langs[ll], langs[ll]->syn0, NULL, prefix);
+  }
+  fclose(fo);
+  free(buf);
+  free(row);
+}
+
+// Saving (-save-every, -save-async): a saved iteration writes every language once. With -save-async
+// the vectors are copied and written by a background thread while the next iteration trains.
+int save_every = 1; // save after every <int>th iteration, 0 = only after the last one
+int save_async = 1;
+struct lang_params **save_snapshots; // copies of all_langs with their own syn0 / syn1neg
+pthread_t save_thread;
+int save_running = 0;
+
+void SaveLanguages(struct lang_params **langs) {
+  int ll;
+  double phase_start;
+  for (ll = 0; ll < num_languages; ll++) {
+    phase_start = WallTime();
+    SaveVector(output_prefix, langs[ll]->lang_name, langs[ll], 1);
+    LogPhase("save_vectors", langs[ll]->lang_name, phase_start);
+  }
+  if (save_merged) {
+    phase_start = WallTime();
+    SaveMerged(langs);
+    LogPhase("save_vectors", "merged", phase_start);
+  }
+}
 
-  // Save the word vectors
-  real *syn0 = params->syn0;
-  FILE* fo = fopen(output_file, "wb");
-  fprintf(fo, "%lld %lld\n", vocab_size, layer1_size);
+void *SaveThread(void *arg) {
+  SaveLanguages((struct lang_params **)arg);
+  pthread_exit(NULL);
+}
 
-  // Save sum out vecs or sum of in and out vecs
-  FILE* fo_sum = NULL;
-  FILE* fo_out = NULL;
-  real *syn1neg = params->syn1neg; // negative sampling
-  if(hs==0) { // only for negative sampling, we have the notion of output vectors
-    if (save_avg_vecs){
-      char sum_vector_file[MAX_STRING];
-      sprintf(sum_vector_file, "%s.sumvec.%s", output_prefix, lang);
-      fo_sum = fopen(sum_vector_file, "wb");
-      fprintf(fo_sum, "%lld %lld\n", vocab_size, layer1_size);
+// Waits for the background save, if any
+void WaitForSave() {
+  if (!save_running) return;
+  pthread_join(save_thread, NULL);
+  save_running = 0;
+}
+
+void SaveAllLanguages(int last) {
+  int ll;
+  long long n;
+  real *syn0, *syn1neg;
+  WaitForSave(); // the snapshots are about to be overwritten
+  final_save = last;
+  writer_threads = save_async && !last ? save_threads : num_threads; // nothing else runs after the last iteration
+  if (!save_async) {
+    SaveLanguages(all_langs);
+    return;
+  }
+  if (save_snapshots == NULL) {
+    save_snapshots = (struct lang_params **)malloc(num_languages * sizeof(struct lang_params *));
+    for (ll = 0; ll < num_languages; ll++) {
+      n = all_langs[ll]->vocab_size * layer1_size;
+      save_snapshots[ll] = (struct lang_params *)malloc(sizeof(struct lang_params));
+      save_snapshots[ll]->syn0 = (real *)malloc(n * sizeof(real));
+      save_snapshots[ll]->syn1neg = negative > 0 ? (real *)malloc(n * sizeof(real)) : NULL;
+      if (save_snapshots[ll]->syn0 == NULL || (negative > 0 && save_snapshots[ll]->syn1neg == NULL)) {
+        printf("ERROR: no memory for the -save-async copy of %s; use -save-async 0\n", all_langs[ll]->lang_name);
+        exit(1);
+      }
     }
+  }
+  for (ll = 0; ll < num_languages; ll++) {
+    n = all_langs[ll]->vocab_size * layer1_size;
+    syn0 = save_snapshots[ll]->syn0;
+    syn1neg = save_snapshots[ll]->syn1neg;
+    *save_snapshots[ll] = *all_langs[ll]; // the vocab is shared, it does not change during training
+    save_snapshots[ll]->syn0 = syn0;
+    save_snapshots[ll]->syn1neg = syn1neg;
+    memcpy(syn0, all_langs[ll]->syn0, n * sizeof(real));
+    if (syn1neg != NULL) memcpy(syn1neg, all_langs[ll]->syn1neg, n * sizeof(real));
+  }
+  pthread_create(&save_thread, NULL, SaveThread, save_snapshots);
+  save_running = 1;
+}
 
-    if (save_out_vecs){
-      char out_vector_file[MAX_STRING];
-      sprintf(out_vector_file, "%s.outvec.%s", output_prefix, lang);
-      fo_out = fopen(out_vector_file, "wb");
-      fprintf(fo_out, "%lld %lld\n", vocab_size, layer1_size);
+// Checkpoints (-checkpoint, -resume): the state needed to continue training after an iteration, or
+// within one (mid_iter), written to <file>.tmp and renamed over <file>, so a crash leaves the
+// previous checkpoint intact. Layout: struct checkpoint_header, a struct checkpoint_lang per
+// language, then per language syn0, syn1 (with -hs 1) and syn1neg (with -negative > 0), and for
+// mid_iter the thread_checkpoint of every thread followed by their pair_checkpoints. Word counters
+// restart every iteration, and so do the random generators, seeded from the thread ids; at an
+// iteration boundary neither needs more saved state.
+#define CHECKPOINT_MAGIC "MVCKPT01"
+struct checkpoint_header {
+  char magic[8];
+  long long next_iter, num_train_iters, layer1_size, hs, negative, real_size, num_languages, train_words_total;
+  double starting_alpha;
+  long long mid_iter, num_threads, num_pairs, word_count_actual;
+};
+double last_checkpoint; // wall-clock time of the last checkpoint
+struct checkpoint_lang {
+  char lang_name[32];
+  long long vocab_size, fingerprint;
+};
+char checkpoint_file[MAX_STRING], resume_file[MAX_STRING];
+
+// FNV-1a hash of the words and counts of the vocab, in order
+long long VocabFingerprint(struct lang_params *params) {
+  unsigned long long hash = 14695981039346656037ULL;
+  long long a;
+  unsigned char *p;
+  int b;
+  for (a = 0; a < params->vocab_size; a++) {
+    for (p = (unsigned char *)GetVocabWord(params, a); *p; p++) hash = (hash ^ *p) * 1099511628211ULL;
+    for (b = 0; b < 8; b++) hash = (hash ^ ((params->vocab_cn[a] >> (b * 8)) & 255)) * 1099511628211ULL;
+  }
+  return (long long)hash;
+}
+
+void CheckpointLayout(struct checkpoint_header *header, struct checkpoint_lang *langs, int next_iter, int mid_iter) {
+  int ll;
+  memset(header, 0, sizeof(struct checkpoint_header));
+  memset(langs, 0, num_languages * sizeof(struct checkpoint_lang));
+  memcpy(header->magic, CHECKPOINT_MAGIC, 8);
+  header->next_iter = next_iter;
+  header->num_train_iters = num_train_iters;
+  header->layer1_size = layer1_size;
+  header->hs = hs;
+  header->negative = negative;
+  header->real_size = sizeof(real);
+  header->num_languages = num_languages;
+  header->train_words_total = train_words_total;
+  header->starting_alpha = starting_alpha;
+  header->mid_iter = mid_iter;
+  header->num_threads = num_threads;
+  header->num_pairs = num_pairs;
+  header->word_count_actual = mid_iter ? word_count_actual : 0;
+  for (ll = 0; ll < num_languages; ll++) {
+    if (snprintf(langs[ll].lang_name, sizeof(langs[ll].lang_name), "%s", all_langs[ll]->lang_name) >= (int)sizeof(langs[ll].lang_name)) {
+      printf("! checkpoints keep the first %d characters of the language name %s\n", (int)sizeof(langs[ll].lang_name) - 1,
+             all_langs[ll]->lang_name);
     }
+    langs[ll].vocab_size = all_langs[ll]->vocab_size;
+    langs[ll].fingerprint = VocabFingerprint(all_langs[ll]);
   }
+}
 
-  for (a = 0; a < vocab_size; a++) {
-    fprintf(fo, "%s ", vocab[a].word);
-    if(hs==0) {
-      if (save_avg_vecs) fprintf(fo_sum, "%s ", vocab[a].word);
-      if (save_out_vecs) fprintf(fo_out, "%s ", vocab[a].word);
+// Writes the state after next_iter iterations, or within iteration next_iter with mid_iter and the
+// training threads paused; a failure is reported and training goes on
+void WriteCheckpoint(int next_iter, int mid_iter) {
+  struct checkpoint_header header;
+  struct checkpoint_lang *langs = (struct checkpoint_lang *)malloc(num_languages * sizeof(struct checkpoint_lang));
+  char tmp_file[MAX_STRING + 8], *buf = (char *)malloc(SAVE_BUFFER);
+  double phase_start = WallTime();
+  long long n;
+  int ll, ok;
+  FILE *fo;
+  sprintf(tmp_file, "%s.tmp", checkpoint_file);
+  fo = fopen(tmp_file, "wb");
+  if (fo == NULL) {
+    printf("! cannot write checkpoint %s\n", tmp_file);
+    free(langs);
+    free(buf);
+    return;
+  }
+  setvbuf(fo, buf, _IOFBF, SAVE_BUFFER);
+  CheckpointLayout(&header, langs, next_iter, mid_iter);
+  ok = fwrite(&header, sizeof(header), 1, fo) == 1;
+  ok = ok && fwrite(langs, sizeof(struct checkpoint_lang), num_languages, fo) == (size_t)num_languages;
+  for (ll = 0; ll < num_languages && ok; ll++) {
+    n = all_langs[ll]->vocab_size * layer1_size;
+    ok = fwrite(all_langs[ll]->syn0, sizeof(real), n, fo) == (size_t)n;
+    if (hs) ok = ok && fwrite(all_langs[ll]->syn1, sizeof(real), n, fo) == (size_t)n;
+    if (negative > 0) ok = ok && fwrite(all_langs[ll]->syn1neg, sizeof(real), n, fo) == (size_t)n;
+  }
+  if (mid_iter) {
+    ok = ok && fwrite(thread_checkpoints, sizeof(struct thread_checkpoint), num_threads, fo) == (size_t)num_threads;
+    n = (long long)num_threads * num_pairs;
+    ok = ok && fwrite(pair_checkpoints, sizeof(struct pair_checkpoint), n, fo) == (size_t)n;
+  }
+  ok = fflush(fo) == 0 && ok;
+  ok = fsync(fileno(fo)) == 0 && ok;
+  ok = fclose(fo) == 0 && ok;
+  if (ok) ok = rename(tmp_file, checkpoint_file) == 0;
+  if (!ok) printf("! cannot write checkpoint %s: %s\n", checkpoint_file, strerror(errno));
+  else LogPhase(mid_iter ? "checkpoint_mid_iter" : "checkpoint", checkpoint_file, phase_start);
+  last_checkpoint = WallTime();
+  free(langs);
+  free(buf);
+}
+
+// Restores the vectors from resume_file and continues at the iteration after it
+void ReadCheckpoint() {
+  struct checkpoint_header header, expected;
+  struct checkpoint_lang *langs = (struct checkpoint_lang *)malloc(num_languages * sizeof(struct checkpoint_lang));
+  struct checkpoint_lang *expected_langs = (struct checkpoint_lang *)malloc(num_languages * sizeof(struct checkpoint_lang));
+  long long n;
+  int ll, ok;
+  FILE *fi = fopen(resume_file, "rb");
+  if (fi == NULL) {
+    printf("ERROR: checkpoint %s not found\n", resume_file);
+    exit(1);
+  }
+  CheckpointLayout(&expected, expected_langs, 0, 0);
+  if (fread(&header, sizeof(header), 1, fi) != 1 || memcmp(header.magic, CHECKPOINT_MAGIC, 8)) {
+    printf("ERROR: %s is not a checkpoint\n", resume_file);
+    exit(1);
+  }
+  if (header.layer1_size != expected.layer1_size || header.hs != expected.hs || header.negative != expected.negative ||
+      header.real_size != expected.real_size || header.num_languages != expected.num_languages) {
+    printf("ERROR: checkpoint %s was written with other -size, -hs, -negative or languages\n", resume_file);
+    exit(1);
+  }
+  if (fread(langs, sizeof(struct checkpoint_lang), num_languages, fi) != (size_t)num_languages) {
+    printf("ERROR: checkpoint %s is truncated\n", resume_file);
+    exit(1);
+  }
+  for (ll = 0; ll < num_languages; ll++) {
+    if (strcmp(langs[ll].lang_name, expected_langs[ll].lang_name) || langs[ll].vocab_size != expected_langs[ll].vocab_size ||
+        langs[ll].fingerprint != expected_langs[ll].fingerprint) {
+      printf("ERROR: the %s vocab differs from the one in checkpoint %s\n", all_langs[ll]->lang_name, resume_file);
+      exit(1);
     }
+  }
+  for (ll = 0, ok = 1; ll < num_languages && ok; ll++) {
+    n = all_langs[ll]->vocab_size * layer1_size;
+    ok = fread(all_langs[ll]->syn0, sizeof(real), n, fi) == (size_t)n;
+    if (hs) ok = ok && fread(all_langs[ll]->syn1, sizeof(real), n, fi) == (size_t)n;
+    if (negative > 0) ok = ok && fread(all_langs[ll]->syn1neg, sizeof(real), n, fi) == (size_t)n;
+  }
+  if (ok && header.mid_iter) {
+    if (!mid_checkpoints || header.num_threads != num_threads || header.num_pairs != num_pairs) {
+      printf("ERROR: checkpoint %s was written within an iteration; resuming it needs the same -threads and\n", resume_file);
+      printf("file pairs, plain training files, no -reader-threads and no -corpus-memory\n");
+      exit(1);
+    }
+    ok = fread(thread_checkpoints, sizeof(struct thread_checkpoint), num_threads, fi) == (size_t)num_threads;
+    n = (long long)num_threads * num_pairs;
+    ok = ok && fread(pair_checkpoints, sizeof(struct pair_checkpoint), n, fi) == (size_t)n;
+    resume_mid_iter = 1;
+    word_count_actual = header.word_count_actual;
+  }
+  if (!ok) {
+    printf("ERROR: checkpoint %s is truncated\n", resume_file);
+    exit(1);
+  }
+  fclose(fi);
+  // the learning rate schedule and subsampling depend on the word counts, so other training files
+  // make the resumed run differ from the original one
+  if (header.train_words_total != train_words_total) {
+    printf("! the checkpointed run counted %lld training words per iteration, this one %lld\n",
+           header.train_words_total, train_words_total);
+  }
+  if (header.num_train_iters != num_train_iters || header.starting_alpha != starting_alpha) {
+    printf("! -iter or -alpha differ from the checkpointed run; the learning rate schedule follows the new ones\n");
+  }
+  start_iter = header.next_iter;
+  if (resume_mid_iter) printf("# Resuming from %s within iteration %d\n", resume_file, start_iter);
+  else printf("# Resuming from %s after %d iterations\n", resume_file, start_iter);
+  if (start_iter >= num_train_iters) printf("! all %d iterations are done already\n", num_train_iters);
+  free(langs);
+  free(expected_langs);
+}
 
-    if (binary) { // binary
-      for (b = 0; b < layer1_size; b++) {
-        fwrite(&syn0[a * layer1_size + b], sizeof(real), 1, fo);
+// Warm start (-init-vectors): syn0 rows of words an earlier model knew are copied from it, the
+// others keep their random initialization. The source is either a checkpoint, which restores syn0,
+// syn1 and syn1neg of every language whose vocab is unchanged, or saved vectors <prefix>.<lang> in
+// any -binary format, matched by word. With -freeze 1 the copied rows of syn0 stay as they are,
+// while new words and the output weights train.
+char init_vectors[MAX_STRING];
+int freeze = 0;
+
+void WarmRow(struct lang_params *params, long long a) {
+  if (!freeze) return;
+  if (params->frozen == NULL) params->frozen = (char *)calloc(params->vocab_size, 1);
+  params->frozen[a] = 1;
+}
 
-        if(hs==0) {
-          if (save_avg_vecs) {
-            sum = syn0[a * layer1_size + b] + syn1neg[a * layer1_size + b];
-            fwrite(&sum, sizeof(real), 1, fo_sum);
-          }
-          if (save_out_vecs) fwrite(&syn1neg[a * layer1_size + b], sizeof(real), 1, fo_out);
+void WarmStartFromCheckpoint(FILE *fi) {
+  struct checkpoint_header header, expected;
+  struct checkpoint_lang *langs, *expected_langs = (struct checkpoint_lang *)malloc(num_languages * sizeof(struct checkpoint_lang));
+  long long a, n, pos;
+  int l, ll, ok = 1;
+  CheckpointLayout(&expected, expected_langs, 0, 0);
+  if (fread(&header, sizeof(header), 1, fi) != 1 || header.layer1_size != layer1_size || header.real_size != sizeof(real)) {
+    printf("ERROR: checkpoint %s was written with another -size\n", init_vectors);
+    exit(1);
+  }
+  langs = (struct checkpoint_lang *)malloc(header.num_languages * sizeof(struct checkpoint_lang));
+  if (fread(langs, sizeof(struct checkpoint_lang), header.num_languages, fi) != (size_t)header.num_languages) ok = 0;
+  pos = sizeof(header) + header.num_languages * sizeof(struct checkpoint_lang);
+  for (l = 0; l < header.num_languages && ok; l++) {
+    n = langs[l].vocab_size * layer1_size;
+    for (ll = 0; ll < num_languages; ll++) if (!strcmp(langs[l].lang_name, expected_langs[ll].lang_name)) break;
+    if (ll < num_languages && all_langs[ll]->full_vocab) {
+      if (langs[l].vocab_size != expected_langs[ll].vocab_size || langs[l].fingerprint != expected_langs[ll].fingerprint) {
+        printf("! the %s vocab differs from the one in checkpoint %s; warm-start it from saved vectors instead\n",
+               langs[l].lang_name, init_vectors);
+      } else {
+        fseeko(fi, pos, SEEK_SET);
+        ok = fread(all_langs[ll]->syn0, sizeof(real), n, fi) == (size_t)n;
+        if (header.hs) {
+          if (hs) ok = ok && fread(all_langs[ll]->syn1, sizeof(real), n, fi) == (size_t)n;
+          else fseeko(fi, n * sizeof(real), SEEK_CUR);
         }
-
+        if (header.negative > 0 && negative > 0) ok = ok && fread(all_langs[ll]->syn1neg, sizeof(real), n, fi) == (size_t)n;
+        for (a = 0; a < langs[l].vocab_size; a++) WarmRow(all_langs[ll], a);
+        printf("# %s: all %lld vectors taken from checkpoint %s\n", langs[l].lang_name, langs[l].vocab_size, init_vectors);
       }
-    } else { // text
-      for (b = 0; b < layer1_size; b++) {
-        fprintf(fo, "%lf ", syn0[a * layer1_size + b]);
+    }
+    pos += n * sizeof(real) * (1 + (header.hs != 0) + (header.negative > 0));
+  }
+  if (!ok) {
+    printf("ERROR: checkpoint %s is truncated\n", init_vectors);
+    exit(1);
+  }
+  free(langs);
+  free(expected_langs);
+}
 
-        if(hs==0) {
-          if (save_avg_vecs) {
-            sum = syn0[a * layer1_size + b] + syn1neg[a * layer1_size + b];
-            fprintf(fo_sum, "%lf ", sum);
-          }
-          if (save_out_vecs) fprintf(fo_out, "%lf ", syn1neg[a * layer1_size + b]);
-        }
+void WarmStartFromVectors(struct lang_params *params, char *file_name) {
+  struct embedding_header header;
+  char word[MAX_STRING], word_format[16], *strings = NULL;
+  long long a, b, id, v = 0, size = 0, pos, found = 0, *offsets = NULL;
+  int binary, mapped;
+  sprintf(word_format, "%%%ds", MAX_STRING - 1); // fscanf must not run past word
+  real *row = (real *)malloc(layer1_size * sizeof(real));
+  FILE *fi = fopen(file_name, "rb");
+  if (fi == NULL) {
+    printf("# %s: no %s, all vectors start random\n", params->lang_name, file_name);
+    free(row);
+    return;
+  }
+  mapped = fread(&header, sizeof(header), 1, fi) == 1 && !memcmp(header.magic, EMBEDDING_MAGIC, 8);
+  if (mapped) {
+    v = header.vocab_size;
+    size = header.size;
+    offsets = (long long *)malloc((v + 1) * sizeof(long long));
+    fseeko(fi, header.offsets_offset, SEEK_SET);
+    if (fread(offsets, sizeof(long long), v + 1, fi) != (size_t)(v + 1)) v = -1;
+    else {
+      strings = (char *)malloc(offsets[v]);
+      fseeko(fi, header.strings_offset, SEEK_SET);
+      if (fread(strings, 1, offsets[v], fi) != (size_t)offsets[v]) v = -1;
+    }
+    fseeko(fi, header.matrix_offset, SEEK_SET);
+  } else {
+    rewind(fi);
+    if (fscanf(fi, "%lld %lld", &v, &size) != 2) v = -1;
+  }
+  if (v < 0 || size != layer1_size) {
+    printf("ERROR: %s is not a vector file of -size %lld\n", file_name, layer1_size);
+    exit(1);
+  }
+  // a text row parses as a word and size numbers, a binary one does not
+  pos = ftello(fi);
+  binary = !mapped && fscanf(fi, word_format, word) != 1;
+  for (b = 0; b < layer1_size && !mapped && !binary; b++) binary = fscanf(fi, "%f", &row[b]) != 1;
+  fseeko(fi, pos, SEEK_SET);
+  for (a = 0; a < v; a++) {
+    if (mapped) {
+      snprintf(word, MAX_STRING, "%s", strings + offsets[a]);
+      if (fread(row, sizeof(real), layer1_size, fi) != (size_t)layer1_size) break;
+    } else {
+      if (fscanf(fi, word_format, word) != 1) break;
+      if (binary) {
+        fgetc(fi);
+        if (fread(row, sizeof(real), layer1_size, fi) != (size_t)layer1_size) break;
+      } else {
+        for (b = 0; b < layer1_size; b++) if (fscanf(fi, "%f", &row[b]) != 1) break;
+        if (b < layer1_size) break;
       }
     }
-    fprintf(fo, "\n");
+    id = SearchVocab(word, params);
+    if (id < 0) continue;
+    memcpy(&params->syn0[id * layer1_size], row, layer1_size * sizeof(real));
+    WarmRow(params, id);
+    found++;
+  }
+  if (a < v) printf("! %s ends after %lld of its %lld vectors\n", file_name, a, v);
+  printf("# %s: %lld of %lld vectors taken from %s, %lld new words\n", params->lang_name, found, params->vocab_size,
+         file_name, params->vocab_size - found);
+  fclose(fi);
+  free(offsets);
+  free(strings);
+  free(row);
+}
 
-    if(hs==0) {
-      if (save_avg_vecs) fprintf(fo_sum, "\n");
-      if (save_out_vecs) fprintf(fo_out, "\n");
+void WarmStart() {
+  char magic[8], file_name[MAX_STRING * 2];
+  double phase_start = WallTime();
+  int ll;
+  FILE *fi = fopen(init_vectors, "rb");
+  if (fi != NULL && fread(magic, 1, 8, fi) == 8 && !memcmp(magic, CHECKPOINT_MAGIC, 8)) {
+    rewind(fi);
+    WarmStartFromCheckpoint(fi);
+  } else for (ll = 0; ll < num_languages; ll++) {
+    if (!all_langs[ll]->full_vocab) continue;
+    sprintf(file_name, "%s.%s", init_vectors, all_langs[ll]->lang_name);
+    WarmStartFromVectors(all_langs[ll], file_name);
+  }
+  if (fi != NULL) fclose(fi);
+  LogPhase("warm_start", init_vectors, phase_start);
+}
+
+void CheckpointSignal(int signal) {
+  checkpoint_signal = signal;
+}
+
+// Joins the training threads of an iteration. With mid-iteration checkpoints it wakes up every
+// second, and when one is due (-checkpoint-interval elapsed, or a signal came) it pauses the
+// threads at their next sentence boundary and writes it. After SIGTERM it stops there.
+void JoinTrainingThreads(pthread_t *pt) {
+  struct timespec until;
+  long long a;
+  int due;
+  if (mid_checkpoints) {
+    pthread_mutex_lock(&quiesce_lock);
+    while (threads_running > 0) {
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec += 1;
+      pthread_cond_timedwait(&quiesce_cond, &quiesce_lock, &until);
+      due = checkpoint_signal != 0 || (checkpoint_interval > 0 && WallTime() - last_checkpoint >= checkpoint_interval);
+      if (!due || threads_running == 0) continue;
+      __atomic_store_n(&quiesce_requested, 1, __ATOMIC_RELEASE);
+      while (threads_paused < threads_running) pthread_cond_wait(&quiesce_cond, &quiesce_lock);
+      WriteCheckpoint(cur_iter, 1);
+      if (checkpoint_signal == SIGTERM) {
+        printf("# Stopped by SIGTERM; continue with -resume %s\n", checkpoint_file);
+        fflush(stdout);
+        WaitForSave();
+        exit(1);
+      }
+      checkpoint_signal = 0;
+      __atomic_store_n(&quiesce_requested, 0, __ATOMIC_RELEASE);
+      pthread_cond_broadcast(&quiesce_cond);
     }
+    pthread_mutex_unlock(&quiesce_lock);
   }
-  fclose(fo);
-  
-  if(hs==0) {
-    if (save_avg_vecs) fclose(fo_sum);
-    if (save_out_vecs) fclose(fo_out);
+  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+}
+
+// Init cache: everything LanguageInit derives for a language before training starts (sorted vocab,
+// Huffman paths, unigram table, random syn0), stored in <vocab_file>.init and mmap'ed back on the
+// next run when the vocab file and the settings it depends on are unchanged.
+// Layout: struct init_cache_header, then the sections below, each starting on a page boundary.
+enum {
+  CACHE_VOCAB_CN, CACHE_VOCAB_WORD, CACHE_VOCAB_STRINGS, CACHE_VOCAB_CODELEN, CACHE_VOCAB_PATH,
+  CACHE_VOCAB_CODE, CACHE_VOCAB_POINT, CACHE_TABLE, CACHE_SYN0, CACHE_END
+};
+
+struct init_cache_header {
+  char magic[8];
+  // key
+  long long vocab_file_size, vocab_file_mtime /* ns */, min_count, hs, negative, layer1_size, seed, table_size, real_size;
+  // contents
+  long long vocab_size, total_words, strings_size, path_size;
+};
+
+// Fills offsets with the start of every section (offsets[CACHE_END] is the file size)
+void InitCacheLayout(const struct init_cache_header *header, long long *offsets) {
+  long long sizes[CACHE_END], a, pos = sizeof(struct init_cache_header);
+  long long v = header->vocab_size;
+  sizes[CACHE_VOCAB_CN] = v * sizeof(long long);
+  sizes[CACHE_VOCAB_WORD] = v * sizeof(long long);
+  sizes[CACHE_VOCAB_STRINGS] = header->strings_size;
+  sizes[CACHE_VOCAB_CODELEN] = header->hs ? v * sizeof(char) : 0;
+  sizes[CACHE_VOCAB_PATH] = header->hs ? v * sizeof(long long) : 0;
+  sizes[CACHE_VOCAB_CODE] = header->path_size * sizeof(char);
+  sizes[CACHE_VOCAB_POINT] = header->path_size * sizeof(int);
+  sizes[CACHE_TABLE] = header->negative > 0 ? header->table_size * sizeof(int) : 0;
+  sizes[CACHE_SYN0] = v * header->layer1_size * sizeof(real);
+  for (a = 0; a < CACHE_END; a++) {
+    pos = (pos + 4095) / 4096 * 4096;
+    offsets[a] = pos;
+    pos += sizes[a];
+  }
+  offsets[CACHE_END] = pos;
+}
+
+// Fills the key part of header from the current settings; returns 0 if the vocab file is missing
+int InitCacheKey(struct lang_params *params, struct init_cache_header *header) {
+  struct stat st;
+  memset(header, 0, sizeof(struct init_cache_header));
+  if (stat(params->vocab_file, &st) != 0) return 0;
+  memcpy(header->magic, "MVINIT01", 8);
+  header->vocab_file_size = st.st_size;
+  header->vocab_file_mtime = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  header->min_count = min_count;
+  header->hs = hs;
+  header->negative = negative;
+  header->layer1_size = layer1_size;
+  header->seed = init_seed;
+  header->table_size = table_size;
+  header->real_size = sizeof(real);
+  return 1;
+}
+
+void WriteInitCacheSection(FILE *fo, long long offset, const void *data, long long size) {
+  fseek(fo, offset, SEEK_SET);
+  if (size > 0) fwrite(data, 1, size, fo);
+}
+
+void WriteInitCache(struct lang_params *params) {
+  char cache_file[MAX_STRING + 8], tmp_file[MAX_STRING + 16];
+  long long offsets[CACHE_END + 1];
+  struct init_cache_header header;
+  FILE *fo;
+
+  if (!InitCacheKey(params, &header)) return;
+  header.vocab_size = params->vocab_size;
+  header.total_words = params->total_words;
+  header.strings_size = params->vocab_strings_size;
+  header.path_size = 0;
+  if (hs) header.path_size = params->vocab_path[params->vocab_size - 1] + params->vocab_codelen[params->vocab_size - 1];
+  InitCacheLayout(&header, offsets);
+
+  sprintf(cache_file, "%s.init", params->vocab_file);
+  sprintf(tmp_file, "%s.tmp", cache_file);
+  fo = fopen(tmp_file, "wb");
+  if (fo == NULL) {
+    printf("! Cannot write init cache %s\n", tmp_file);
+    return;
   }
+  fwrite(&header, sizeof(struct init_cache_header), 1, fo);
+  WriteInitCacheSection(fo, offsets[CACHE_VOCAB_CN], params->vocab_cn, params->vocab_size * sizeof(long long));
+  WriteInitCacheSection(fo, offsets[CACHE_VOCAB_WORD], params->vocab_word, params->vocab_size * sizeof(long long));
+  WriteInitCacheSection(fo, offsets[CACHE_VOCAB_STRINGS], params->vocab_strings, header.strings_size);
+  if (hs) {
+    WriteInitCacheSection(fo, offsets[CACHE_VOCAB_CODELEN], params->vocab_codelen, params->vocab_size * sizeof(char));
+    WriteInitCacheSection(fo, offsets[CACHE_VOCAB_PATH], params->vocab_path, params->vocab_size * sizeof(long long));
+    WriteInitCacheSection(fo, offsets[CACHE_VOCAB_CODE], params->vocab_code, header.path_size * sizeof(char));
+    WriteInitCacheSection(fo, offsets[CACHE_VOCAB_POINT], params->vocab_point, header.path_size * sizeof(int));
+  }
+  if (negative > 0) WriteInitCacheSection(fo, offsets[CACHE_TABLE], params->table, (long long)table_size * sizeof(int));
+  WriteInitCacheSection(fo, offsets[CACHE_SYN0], params->syn0, params->vocab_size * layer1_size * sizeof(real));
+  if (ftruncate(fileno(fo), offsets[CACHE_END]) != 0 || fclose(fo) != 0) {
+    printf("! Cannot write init cache %s\n", tmp_file);
+    unlink(tmp_file);
+    return;
+  }
+  rename(tmp_file, cache_file);
+  printf("# Saved init cache %s\n", cache_file);
+}
+
+// Maps the init cache of a language if it matches the current vocab file and settings, and points
+// the vocab arrays, unigram table and syn0 into it. Returns 0 if there is no usable cache.
+int ReadInitCache(struct lang_params *params) {
+  char cache_file[MAX_STRING + 8];
+  long long offsets[CACHE_END + 1];
+  struct init_cache_header header, key;
+  struct stat st;
+  char *data;
+  int fd;
+
+  if (!InitCacheKey(params, &key)) return 0;
+  sprintf(cache_file, "%s.init", params->vocab_file);
+  fd = open(cache_file, O_RDONLY);
+  if (fd < 0) return 0;
+  if (read(fd, &header, sizeof(struct init_cache_header)) != sizeof(struct init_cache_header) ||
+      memcmp(&header, &key, offsetof(struct init_cache_header, vocab_size)) || header.vocab_size <= 0) {
+    printf("# Init cache %s is stale, rebuilding\n", cache_file);
+    close(fd);
+    return 0;
+  }
+  InitCacheLayout(&header, offsets);
+  if (fstat(fd, &st) != 0 || st.st_size < offsets[CACHE_END]) {
+    close(fd);
+    return 0;
+  }
+  // private mapping: training writes to syn0 stay in memory
+  data = (char *)mmap(NULL, offsets[CACHE_END], PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return 0;
+
+  free(params->vocab_cn);
+  free(params->vocab_word);
+  free(params->vocab_strings);
+  params->vocab_size = header.vocab_size;
+  params->vocab_max_size = header.vocab_size + 1;
+  params->total_words = header.total_words;
+  params->vocab_cn = (long long *)(data + offsets[CACHE_VOCAB_CN]);
+  params->vocab_word = (long long *)(data + offsets[CACHE_VOCAB_WORD]);
+  params->vocab_strings = data + offsets[CACHE_VOCAB_STRINGS];
+  params->vocab_strings_size = params->vocab_strings_max_size = header.strings_size;
+  if (hs) {
+    params->vocab_codelen = data + offsets[CACHE_VOCAB_CODELEN];
+    params->vocab_path = (long long *)(data + offsets[CACHE_VOCAB_PATH]);
+    params->vocab_code = data + offsets[CACHE_VOCAB_CODE];
+    params->vocab_point = (int *)(data + offsets[CACHE_VOCAB_POINT]);
+  }
+  if (negative > 0) params->table = (int *)(data + offsets[CACHE_TABLE]);
+  params->syn0 = (real *)(data + offsets[CACHE_SYN0]);
+  RehashVocab(params);
+  params->full_vocab = 1;
+  printf("# Loaded init cache %s (%lld words)\n", cache_file, params->vocab_size);
+  return 1;
 }
 
 // init vocab, unk_id, vector table for each language
 void LanguageInit(struct lang_params *params){
   puts("Calling LanguageInit");
+  double phase_start = WallTime();
+  int cached = init_cache && ReadInitCache(params);
+  long long a, b;
   /* initialize full vocabulary by reading vocab file or all training files */
-  if (access(params->vocab_file, F_OK) != -1) { // vocab file exists
+  if (cached) {
+    printf("# Vocab, tree, table and initial vectors of %s loaded from the init cache\n", params->lang_name);
+    LogPhase("read_init_cache", params->lang_name, phase_start);
+  } else if (access(params->vocab_file, F_OK) != -1) { // vocab file exists
     printf("# Vocab file (%s) exists. Loading ...\n", params->vocab_file);
     ReadVocab(params);
+    LogPhase("read_vocab", params->lang_name, phase_start);
   } else { // vocab file doesn't exist
+    for (a = 0; a < params->num_files && IsStreamFile(params->files[a]->train_file); a++);
+    if (a == params->num_files) {
+      printf("ERROR: all training files of %s are pipes, so its vocab must be given in %s\n", params->lang_name, params->vocab_file);
+      exit(1);
+    }
     printf("# Vocab file (%s) doesn't exist. Deriving ...\n", params->vocab_file);
     LearnVocabFromTrainFiles(params);
     printf("Vocab learnt...\n");
     SaveVocab(params);
     printf("Vocab saved.\n");
+    LogPhase("learn_vocab", params->lang_name, phase_start);
   }
 
   /* set unk_id from vocab */
-  params->unk_id = params->vocab_hash[GetWordHash("<unk>")];
+  if (perfect_hash) FreezeVocab(params);
+  params->unk_id = SearchVocab("<unk>", params);
   if (params->unk_id<0){
     fprintf(stderr, "! Can't find <unk> in the vocab file %s\n", params->vocab_file);
     exit(1);
@@ -1368,10 +3598,11 @@ void LanguageInit(struct lang_params *params){
   sprintf(params->output_file, "%s.%s", output_prefix, params->lang_name);
 
   /* initializes space for the embeddings arrays based on vocab_size */
-  long long a, b;
-  unsigned long long next_random = 1;
-  a = posix_memalign((void **)&params->syn0, 128, (long long)params->vocab_size * layer1_size * sizeof(real));
-  if (params->syn0 == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  unsigned long long next_random = init_seed;
+  if (!cached) {
+    a = posix_memalign((void **)&params->syn0, 128, (long long)params->vocab_size * layer1_size * sizeof(real));
+    if (params->syn0 == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  }
   if (hs) {
     // this is because the number of nodes in a tree is approximately the number of words.
     a = posix_memalign((void **)&params->syn1, 128, (long long)params->vocab_size * layer1_size * sizeof(real));
@@ -1385,13 +3616,30 @@ void LanguageInit(struct lang_params *params){
     for (a = 0; a < params->vocab_size; a++) for (b = 0; b < layer1_size; b++)
      params->syn1neg[a * layer1_size + b] = 0;
   }
-  for (a = 0; a < params->vocab_size; a++) for (b = 0; b < layer1_size; b++) {
-    next_random = next_random * (unsigned long long)25214903917 + 11;
-    params->syn0[a * layer1_size + b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / layer1_size;
-  }
-  CreateBinaryTree(params);
+  if (!cached) {
+    phase_start = WallTime();
+    for (a = 0; a < params->vocab_size; a++) for (b = 0; b < layer1_size; b++) {
+      next_random = next_random * (unsigned long long)25214903917 + 11;
+      params->syn0[a * layer1_size + b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / layer1_size;
+    }
+    LogPhase("init_vectors", params->lang_name, phase_start);
+    if (hs) {
+      phase_start = WallTime();
+      CreateBinaryTree(params);
+      LogPhase("binary_tree", params->lang_name, phase_start);
+    }
 
-  if (negative > 0) InitUnigramTable(params);
+    if (negative > 0) {
+      phase_start = WallTime();
+      InitUnigramTable(params);
+      LogPhase("unigram_table", params->lang_name, phase_start);
+    }
+    if (init_cache) {
+      phase_start = WallTime();
+      WriteInitCache(params);
+      LogPhase("write_init_cache", params->lang_name, phase_start);
+    }
+  }
 
 #ifdef DEBUG
     printf("  MonoInit Vocab size: %lld\n", params->vocab_size);
@@ -1401,13 +3649,33 @@ void LanguageInit(struct lang_params *params){
 }
 
 void MonoInit(struct file_params *params) {
+  long long a;
   puts("Calling MonoInit");
   if (params->lang->full_vocab == 0) {
     LanguageInit(params->lang);
   }
-  //get params->train_words in case vocab was already known
-  CountWordsFromTrainFile(params);
-  ComputeBlockStartPoints(params->train_file, num_threads, &params->line_blocks, &params->num_lines);
+  if (IsStreamFile(params->train_file)) {
+    // progress through a pipe is measured against the expected size, or else its share of the vocab counts
+    params->train_words = expected_words;
+    if (expected_words == 0) {
+      for (a = 0; a < params->lang->vocab_size; a++) params->train_words += params->lang->vocab_cn[a];
+      params->train_words /= params->lang->num_files;
+    }
+    params->line_blocks = NULL;
+    printf("# %s is a pipe, expecting %lld words\n", params->train_file, params->train_words);
+  } else {
+    double phase_start = WallTime();
+    //get params->train_words in case vocab was already known
+    CountWordsFromTrainFile(params);
+    // the dispatcher reads the files whole, without block split points
+    if (stream_mode) params->line_blocks = NULL;
+    else ComputeBlockStartPoints(params->train_file, num_threads, &params->line_blocks, &params->num_lines);
+    LogPhase("line_index", params->train_file, phase_start);
+  }
+  if (corpus_memory > 0) {
+    params->blocks = (struct block_corpus *)calloc(num_threads, sizeof(struct block_corpus));
+    for (a = 0; a < num_threads; a++) params->blocks[a].state = CORPUS_RECORD;
+  }
   puts("Exiting MonoInit");
 }
 
@@ -1419,6 +3687,10 @@ void TrainAllLanguagePairs() {
   struct file_params *tgt;
 
   pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  pthread_t *rt = (pthread_t *)malloc(reader_threads * sizeof(pthread_t));
+  double phase_start, train_seconds = 0;
+  thread_stats = (struct thread_stats *)calloc(num_threads, sizeof(struct thread_stats));
+  if (perf_counters) perf_counts = (long long *)calloc((long long)num_threads * num_pairs * PERF_SLOTS, sizeof(long long));
   starting_alpha = alpha;
   if (output_prefix[0] == 0) {
     printf("Output prefix is empty, exiting");
@@ -1435,39 +3707,73 @@ void TrainAllLanguagePairs() {
     MonoInit(tgt);
 
     puts("Finished MonoInit");
+    if (align_opt > 0 && !IsStreamFile(pair->align_file)) pair->align_binary = IsBinaryAlignFile(pair->align_file);
+    if (stream_mode) continue; // files are read whole by the dispatcher, without block split points
     assert(src->num_lines==tgt->num_lines);
 
     if (align_opt > 0) {
+      phase_start = WallTime();
       ComputeBlockStartPoints(pair->align_file, num_threads, &pair->align_line_blocks, &pair->align_num_lines);
+      LogPhase("line_index", pair->align_file, phase_start);
       assert(src->num_lines==pair->align_num_lines);
     }
   }  
-  int save_opt = 1;
+  if (reader_threads > 0) InitBatchQueues();
+  for (current_pair=0; current_pair<num_pairs; current_pair++) {
+    train_words_total += all_pairs[current_pair]->src->train_words + all_pairs[current_pair]->tgt->train_words;
+  }
+  if (checkpoint_file[0] != 0 || resume_file[0] != 0) {
+    mid_checkpoints = reader_threads == 0 && !stream_mode && corpus_memory == 0;
+    for (current_pair = 0; current_pair < num_pairs; current_pair++) {
+      pair = all_pairs[current_pair];
+      if (IsCompressedFile(pair->src->train_file) || IsCompressedFile(pair->tgt->train_file) ||
+          (align_opt && IsCompressedFile(pair->align_file))) mid_checkpoints = 0;
+    }
+    thread_checkpoints = (struct thread_checkpoint *)calloc(num_threads, sizeof(struct thread_checkpoint));
+    pair_checkpoints = (struct pair_checkpoint *)calloc((long long)num_threads * num_pairs, sizeof(struct pair_checkpoint));
+  }
+  if (checkpoint_file[0] != 0) {
+    if (mid_checkpoints) {
+      signal(SIGUSR1, CheckpointSignal);
+      signal(SIGTERM, CheckpointSignal);
+    } else {
+      printf("! checkpoints are only written between iterations with -reader-threads, -corpus-memory, pipes or\n");
+      printf("  compressed files\n");
+    }
+  }
+  if (init_vectors[0] != 0) WarmStart();
+  if (resume_file[0] != 0) ReadCheckpoint();
+  last_checkpoint = WallTime();
+  LogPhase("startup", "total", program_start);
   //char sum_vector_file[MAX_STRING];
   //char sum_vector_prefix[MAX_STRING];
   for(cur_iter=start_iter; cur_iter<num_train_iters; cur_iter++){
     puts("Starting new training iter");
-    start = clock();
-    for (current_pair=0; current_pair<num_pairs; current_pair++) {
-      pair = all_pairs[current_pair];
-      pair->src->word_count_actual = pair->tgt->word_count_actual = 0;
-    }
+    start = WallTime();
+    if (!resume_mid_iter) word_count_actual = 0;
+    alpha = AlphaAt(word_count_actual);
     // Train Model
     fprintf(stderr, "\n## Start iter %d, alpha=%f ... ", cur_iter, alpha); execute("date"); fflush(stderr);
+    for (a = 0; a < reader_threads; a++) ready_queues[a].closed = 0;
+    for (a = 0; a < reader_threads; a++) pthread_create(&rt[a], NULL, ReaderThread, (void *)a);
+    threads_running = num_threads;
     for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
-    for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+    JoinTrainingThreads(pt);
+    for (a = 0; a < reader_threads; a++) pthread_join(rt[a], NULL);
+    resume_mid_iter = 0;
+    alpha = AlphaAt(word_count_actual);
+    train_seconds += WallTime() - start;
+    LogIteration(cur_iter, start, WallTime());
+    if (perf_counters) LogPerfCounters(cur_iter);
     fprintf(stderr, "\n# Done iter %d, alpha=%f, ", cur_iter, alpha); execute("date"); fflush(stderr);
-    for (current_pair=0; current_pair<num_pairs; current_pair++) {
-      pair = all_pairs[current_pair];
-      src = pair->src;
-      tgt = pair->tgt;
-      print_model_stat(src->lang);
-      print_model_stat(tgt->lang);
+    if (corpus_memory > 0 && cur_iter == start_iter) ReportCorpusMemory();
+    for (ll1 = 0; ll1 < num_languages; ll1++) print_model_stat(all_langs[ll1]);
 
-      // Save
-      SaveVector(output_prefix, src->lang->lang_name, src->lang, save_opt);
-      SaveVector(output_prefix, tgt->lang->lang_name, tgt->lang, save_opt);
-    }  
+    // Save
+    if (cur_iter == num_train_iters - 1 || (save_every > 0 && (cur_iter + 1) % save_every == 0)) {
+      SaveAllLanguages(cur_iter == num_train_iters - 1);
+    }
+    if (checkpoint_file[0] != 0) WriteCheckpoint(cur_iter + 1, 0);
     /* Eval
     if (eval_opt) {
       fprintf(stderr, "\n# eval %d, ", cur_iter); execute("date"); fflush(stderr);
@@ -1495,6 +3801,8 @@ void TrainAllLanguagePairs() {
       fflush(stderr);
       } */ //end if eval_opt
   } // for cur_iter
+  WaitForSave();
+  LogRun(train_seconds);
 }
 
 
@@ -1520,7 +3828,18 @@ struct lang_params *InitLangParams(char * lang) {
 
   params->vocab_size = 0;
   params->vocab_max_size = 1000;
-  params->vocab = (struct vocab_word *)calloc(params->vocab_max_size, sizeof(struct vocab_word));
+  params->vocab_cn = (long long *)calloc(params->vocab_max_size, sizeof(long long));
+  params->vocab_word = (long long *)calloc(params->vocab_max_size, sizeof(long long));
+  params->vocab_strings_size = 0;
+  params->vocab_strings_max_size = params->vocab_max_size * 16;
+  params->vocab_strings = (char *)malloc(params->vocab_strings_max_size);
+  params->vocab_codelen = NULL;
+  params->vocab_path = NULL;
+  params->vocab_code = NULL;
+  params->vocab_point = NULL;
+  params->mph_pilot = NULL;
+  params->mph_slots = NULL;
+  params->frozen = NULL;
   params->vocab_hash = (int *)calloc(vocab_hash_size, sizeof(int));
   params->full_vocab = 0;
 
@@ -1540,6 +3859,7 @@ struct pair_params *InitPairParams(struct file_params *src_params, struct file_p
   params->src = src_params;
   params->tgt = tgt_params;
   params->align_num_lines = 0;
+  params->align_binary = 0;
 
   // printf("Exiting InitPairParams\n");
   return params;
@@ -1555,7 +3875,7 @@ struct file_params *InitFileParams(char *filename) {
   params->file_size = 0;
   params->num_lines = 0;
   params->train_words = 0;
-  params->word_count_actual = 0;
+  params->blocks = NULL;
 
   // printf("Exiting InitFileParams\n");
   return params;
@@ -1573,6 +3893,9 @@ void LinkFilesToLangParams() {
     cur_pair = all_pairs[lp1];
     char *src_lang_name = basename(strdup(all_pairs[lp1]->src->train_file));
     char *tgt_lang_name = basename(strdup(all_pairs[lp1]->tgt->train_file));
+    // the language of ende.en.gz is en
+    if (IsCompressedFile(src_lang_name)) src_lang_name[strlen(src_lang_name) - 3] = 0;
+    if (IsCompressedFile(tgt_lang_name)) tgt_lang_name[strlen(tgt_lang_name) - 3] = 0;
     for (ll1=0; ll1<num_languages; ll1++) {
       cur_lang = all_langs[ll1];
       if (!FileLangCmp(cur_lang->lang_name, src_lang_name)) {
@@ -1594,6 +3917,7 @@ void LinkFilesToLangParams() {
 int main(int argc, char **argv) {
   // srand(21260063);
   int i;
+  program_start = WallTime();
   if (argc == 1) {
     printf("WORD VECTOR estimation toolkit v 0.1b\n\n");
     printf("Options:\n");
@@ -1614,6 +3938,92 @@ int main(int argc, char **argv) {
     printf("\t-negative <int>\n");
     printf("\t\tNumber of negative examples; default is 5, common values are 3 - 10 (0 = not used)\n");
     printf("\t-threads <int>\n");
+    printf("\t\tUse <int> threads (default 1); .gz and .xz input is decoded serially, by one dispatcher thread\n");
+    printf("\t-vocab-budget <int>\n");
+    printf("\t\tLearn the vocab with approximate (Space-Saving) counts, tracking at most <int> distinct words;\n");
+    printf("\t\tdefault is 0 (exact counts)\n");
+    printf("\t-perfect-hash <int>\n");
+    printf("\t\tLook up training words through a minimal perfect hash built once the vocab is final and\n");
+    printf("\t\tsaved next to the vocab file as <vocab>.mph; default is 0 (off)\n");
+    printf("\t-line-index-stride <int>\n");
+    printf("\t\tStore the offset of every <int>-th line in the <file>.lidx index kept next to each training\n");
+    printf("\t\tand alignment file; a larger <int> makes the index smaller and finding the thread split\n");
+    printf("\t\tpoints slower; default is 256\n");
+    printf("\t-init-cache <int>\n");
+    printf("\t\tCache the sorted vocab, Huffman tree, unigram table and initial vectors of each language in\n");
+    printf("\t\t<vocab>.init and map them back on later runs with the same settings; default is 0 (off)\n");
+    printf("\t-reader-threads <int>\n");
+    printf("\t\tParse and subsample sentence pairs in <int> separate threads that feed the training threads\n");
+    printf("\t\tthrough bounded queues; default is 0 (each training thread reads its own block)\n");
+    printf("\t-corpus-memory <int>\n");
+    printf("\t\tKeep up to <int> MB of training text in memory as word ids after the first iteration, so that\n");
+    printf("\t\tlater ones do not re-read it; blocks that do not fit are read from disk; default is 0 (off)\n");
+    printf("\t-expected-words <int>\n");
+    printf("\t\tTraining files may be named pipes; they are then read once by a dispatcher thread and need an\n");
+    printf("\t\texisting vocab file. Progress through each pipe is measured against <int> words; default is 0\n");
+    printf("\t\t(the vocab counts of its language, split evenly across the language's files). Alignments read\n");
+    printf("\t\tfrom pipes must be in text format\n");
+    printf("\t-stats-file <file>\n");
+    printf("\t\tWrite wall-clock timings of the setup and output phases and per-thread throughput of every\n");
+    printf("\t\titeration, the total training time and the peak RSS to <file> as JSON lines\n");
+    printf("\t-binary <int>\n");
+    printf("\t\tSave the vectors as text (0), in the word2vec binary format (1) or in a format that can be\n");
+    printf("\t\tmemory-mapped and used in place, with a word hash index (2); default is 0\n");
+    printf("\t-checkpoint <file>\n");
+    printf("\t\tAfter every iteration, atomically replace <file> with the vectors (syn0, syn1, syn1neg) of all\n");
+    printf("\t\tlanguages, their vocab fingerprints and the iteration count\n");
+    printf("\t-resume <file>\n");
+    printf("\t\tRestore the vectors from checkpoint <file> and continue with the iteration after it; the\n");
+    printf("\t\tvocabs, -size, -hs and -negative must be the ones of the checkpointed run\n");
+    printf("\t-checkpoint-interval <int>\n");
+    printf("\t\tAlso write the -checkpoint every <int> seconds within iterations; SIGUSR1 writes one right away\n");
+    printf("\t\tand SIGTERM writes one and stops. Threads pause at their next sentence and -resume goes on from\n");
+    printf("\t\tthere with the same -threads. Needs plain training files, no -reader-threads and no\n");
+    printf("\t\t-corpus-memory; default is 0 (only between iterations)\n");
+    printf("\t-init-vectors <file>\n");
+    printf("\t\tStart from an earlier model instead of random vectors: a -checkpoint <file> restores the\n");
+    printf("\t\tlanguages whose vocab is unchanged, otherwise the vectors saved as <file>.<lang> (any -binary)\n");
+    printf("\t\tare matched by word and words they lack start random\n");
+    printf("\t-freeze <int>\n");
+    printf("\t\tKeep the vectors taken from -init-vectors fixed and train only new words; default is 0\n");
+    printf("\t-save-every <int>\n");
+    printf("\t\tSave the vectors after every <int>th iteration and after the last one; 0 saves only after\n");
+    printf("\t\tthe last one; default is 1\n");
+    printf("\t-save-async <int>\n");
+    printf("\t\tCopy the vectors and write them in the background while the next iteration trains; costs a\n");
+    printf("\t\tcopy of syn0 and syn1neg of every language; default is 1\n");
+    printf("\t-save-threads <int>\n");
+    printf("\t\tThreads formatting a -save-async save while the next iteration trains; the save after the last\n");
+    printf("\t\titeration uses -threads; default is -threads / 4, at least 1\n");
+    printf("\t-quantize <int>\n");
+    printf("\t\tAlso write the vectors quantized for distance: 1 as int8 with a scale per row to <file>.int8,\n");
+    printf("\t\t2 as product quantization codes to <file>.pq, after the last iteration only; default is 0 (off)\n");
+    printf("\t-pq-subvectors <int>\n");
+    printf("\t\tBytes per vector with -quantize 2, each coding -size / <int> dimensions; default is -size / 4\n");
+    printf("\t-save-npy <int>\n");
+    printf("\t\tAlso write the vectors as NumPy arrays <output>.<lang>.npy, the output vectors of negative\n");
+    printf("\t\tsampling as <output>.outvec.<lang>.npy and the words in row order to <output>.<lang>.words;\n");
+    printf("\t\tdefault is 0\n");
+    printf("\t-save-merged <int>\n");
+    printf("\t\tAlso write the vectors of all languages to the single file <output>, every word prefixed with\n");
+    printf("\t\t<lang>:, in text or -binary 1; default is 0\n");
+    printf("\t-save-precision <int>\n");
+    printf("\t\tDigits after the decimal point of the numbers in text vector files, 0 - 12; default is 6\n");
+    printf("\t-perf-counters <int>\n");
+    printf("\t\tCount cycles, instructions, last-level cache and dTLB misses of every training thread around\n");
+    printf("\t\tsentence processing and report them per iteration and language pair (also per thread in the\n");
+    printf("\t\t-stats-file); unavailable counters are skipped; default is 0 (off)\n");
+    printf("\t-convert-align <text> <binary>\n");
+    printf("\t\tConvert a text alignment file to the compact binary format and exit; binary alignment files\n");
+    printf("\t\tcan be given in -pair_filenames in place of text ones\n");
+    return 0;
+  }
+  if ((i = ArgPos((char *)"-convert-align", argc, argv)) > 0) {
+    if (i + 2 >= argc) {
+      printf("ERROR: -convert-align needs a text and a binary file name\n");
+      exit(1);
+    }
+    ConvertAlignFile(argv[i + 1], argv[i + 2]);
     return 0;
   }
 
@@ -1674,6 +4084,63 @@ int main(int argc, char **argv) {
   if ((i = ArgPos((char *)"-negative", argc, argv)) > 0) negative = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-min-count", argc, argv)) > 0) min_count = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-perfect-hash", argc, argv)) > 0) perfect_hash = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-line-index-stride", argc, argv)) > 0) line_index_stride = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-init-cache", argc, argv)) > 0) init_cache = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-reader-threads", argc, argv)) > 0) reader_threads = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-corpus-memory", argc, argv)) > 0) corpus_memory = atoll(argv[i + 1]) * 1024 * 1024;
+  if ((i = ArgPos((char *)"-expected-words", argc, argv)) > 0) expected_words = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-checkpoint", argc, argv)) > 0) strcpy(checkpoint_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-resume", argc, argv)) > 0) strcpy(resume_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-checkpoint-interval", argc, argv)) > 0) checkpoint_interval = atoi(argv[i + 1]);
+  if (checkpoint_interval > 0 && checkpoint_file[0] == 0) {
+    printf("ERROR: -checkpoint-interval needs -checkpoint\n");
+    exit(1);
+  }
+  if ((i = ArgPos((char *)"-init-vectors", argc, argv)) > 0) strcpy(init_vectors, argv[i + 1]);
+  if ((i = ArgPos((char *)"-freeze", argc, argv)) > 0) freeze = atoi(argv[i + 1]);
+  if (freeze && init_vectors[0] == 0) {
+    printf("ERROR: -freeze needs -init-vectors\n");
+    exit(1);
+  }
+  if ((i = ArgPos((char *)"-save-every", argc, argv)) > 0) save_every = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-save-async", argc, argv)) > 0) save_async = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-save-threads", argc, argv)) > 0) save_threads = atoi(argv[i + 1]);
+  if (save_threads <= 0) save_threads = num_threads / 4 > 0 ? num_threads / 4 : 1;
+  if ((i = ArgPos((char *)"-quantize", argc, argv)) > 0) quantize = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-pq-subvectors", argc, argv)) > 0) pq_subvectors = atoi(argv[i + 1]);
+  if (pq_subvectors == 0) pq_subvectors = layer1_size >= 4 ? layer1_size / 4 : 1;
+  if (quantize < 0 || quantize > 2 || (quantize == 2 && (pq_subvectors < 1 || layer1_size % pq_subvectors != 0))) {
+    printf("ERROR: -quantize is 0, 1 or 2, and -pq-subvectors must divide -size\n");
+    exit(1);
+  }
+  if ((i = ArgPos((char *)"-save-npy", argc, argv)) > 0) save_npy = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-save-merged", argc, argv)) > 0) save_merged = atoi(argv[i + 1]);
+  if (save_merged && binary == 2) {
+    printf("ERROR: -save-merged writes text or -binary 1\n");
+    exit(1);
+  }
+  if ((i = ArgPos((char *)"-save-precision", argc, argv)) > 0) save_precision = atoi(argv[i + 1]);
+  if (save_precision < 0 || save_precision > 12) {
+    printf("ERROR: -save-precision must be between 0 and 12\n");
+    exit(1);
+  }
+  if ((i = ArgPos((char *)"-perf-counters", argc, argv)) > 0) perf_counters = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-stats-file", argc, argv)) > 0) {
+    strcpy(stats_file_name, argv[i + 1]);
+    stats_file = fopen(stats_file_name, "wb");
+    if (stats_file == NULL) {
+      printf("ERROR: cannot write %s\n", stats_file_name);
+      exit(1);
+    }
+  }
+  if (reader_threads > num_threads) reader_threads = num_threads;
+  if (reader_threads < 0) reader_threads = 0;
+  if (line_index_stride < 1) line_index_stride = 1;
+  if ((i = ArgPos((char *)"-vocab-budget", argc, argv)) > 0) {
+    vocab_budget = atoll(argv[i + 1]);
+    if (vocab_budget > vocab_hash_size * 0.7) vocab_budget = vocab_hash_size * 0.7;
+  }
   if ((i = ArgPos((char *)"-classes", argc, argv)) > 0) classes = atoi(argv[i + 1]);
 
   // evaluation
@@ -1702,6 +4169,27 @@ int main(int argc, char **argv) {
 
   LinkFilesToLangParams();
 
+  for (lp1=0; lp1<num_pairs; lp1++) {
+    if (IsStreamFile(all_pairs[lp1]->src->train_file) || IsStreamFile(all_pairs[lp1]->tgt->train_file) ||
+        (align_opt && IsStreamFile(all_pairs[lp1]->align_file))) stream_mode = 1;
+  }
+  if (stream_mode) {
+    printf("# Reading from pipes: one dispatcher thread feeds %d training threads\n", num_threads);
+    reader_threads = 1;
+    if (num_train_iters > 1 && corpus_memory == 0) printf("! Iterations after the first re-open the pipes; consider -corpus-memory\n");
+  } else if (num_threads > 1) {
+    // a thread can only reach its block of a compressed file by decoding everything before it, so
+    // the dispatcher decodes each file once instead
+    for (lp1=0; lp1<num_pairs; lp1++) {
+      if (IsCompressedFile(all_pairs[lp1]->src->train_file) || IsCompressedFile(all_pairs[lp1]->tgt->train_file) ||
+          (align_opt && IsCompressedFile(all_pairs[lp1]->align_file))) stream_mode = 1;
+    }
+    if (stream_mode) {
+      printf("# Compressed input: one dispatcher thread decodes it and feeds %d training threads\n", num_threads);
+      reader_threads = 1;
+    }
+  }
+
   // assertions and debugging
   for (lp1=0; lp1<num_pairs; lp1++) {
     struct pair_params *cur_pair = all_pairs[lp1];
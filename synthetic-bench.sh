@@ -0,0 +1,67 @@
+#!/bin/bash
+# End-to-end throughput benchmark of multivec and bivec on a synthetic Zipf corpus (see synthetic-corpus.c).
+# usage: ./synthetic-bench.sh [dir] [thread counts]
+#   dir            where the corpus and models go; default is synthetic
+#   thread counts  e.g. "1 4 16"; default is 1, 2, 4, ... up to the number of CPUs
+# The corpus is shaped by LANGS (default "en de fr"), SENTENCES (100000 per pair), VOCAB (50000) and LENGTH (20);
+# training by SIZE (100), ITER (1) and ALIGN (1 uses the alignment files). An existing corpus is reused.
+# Startup covers vocab learning, initialization and indexing; words/sec is corpus words per second of training.
+
+dir=${1:-synthetic}
+threads=$2
+if [ -z "$threads" ]; then
+  for (( t = 1; t <= $(nproc); t *= 2 )); do threads="$threads $t"; done
+fi
+langs=(${LANGS:-en de fr})
+sentences=${SENTENCES:-100000}
+size=${SIZE:-100}
+iter=${ITER:-1}
+align=${ALIGN:-1}
+bin=$(cd "$(dirname "$0")" && pwd)
+
+pivot=${langs[0]}
+pair_files=()
+for lang in "${langs[@]:1}"; do pair_files+=("$pivot$lang.$pivot" "$pivot$lang.$lang" "$pivot$lang.align"); done
+if [ ! -f "$dir/${pair_files[1]}" ]; then
+  begin=$(date +%s.%N)
+  "$bin/synthetic-corpus" -output "$dir" -num_languages ${#langs[@]} -language_names "${langs[@]}" \
+    -sentences $sentences -vocab ${VOCAB:-50000} -length ${LENGTH:-20} -align $align || exit 1
+  awk -v b=$begin -v e=$(date +%s.%N) 'BEGIN { printf "# corpus generated in %.2fs\n", e - b }'
+fi
+cd "$dir" || exit 1
+
+# words in the training files of multivec (all pairs) and bivec (the first pair)
+multi_words=0
+for (( p = 0; p < ${#pair_files[@]}; p += 3 )); do
+  multi_words=$(( multi_words + $(cat "${pair_files[p]}" "${pair_files[p+1]}" | wc -w) ))
+done
+bi_words=$(cat "${pair_files[0]}" "${pair_files[1]}" | wc -w)
+
+# prints: program threads startup_s train_s words/s words/s/thread peak_rss_MB
+report() {
+  awk -v prog=$1 -v t=$2 -v words=$(( $3 * iter )) '
+    /^# startup total:/ { startup = $4 + 0 }
+    /^# training total:/ { train = $4 + 0 }
+    /^# peak RSS:/ { rss = $4 }
+    END {
+      if (train == 0) { printf "%-8s %7d  failed, see %s.log\n", prog, t, prog; exit }
+      printf "%-8s %7d %9.2f %9.2f %12.0f %14.0f %11.1f\n", prog, t, startup, train, words / train, words / train / t, rss / 1024
+    }' $1.t$2.log
+}
+
+printf "%-8s %7s %9s %9s %12s %14s %11s\n" program threads startup_s train_s words/s words/s/thread peak_rss_MB
+for t in $threads; do
+  rm -f *.vocab.min* *.lidx # every row pays for vocab learning and the line index scan
+  "$bin/multivec" -num_languages ${#langs[@]} -language_names "${langs[@]}" -num_pairs $(( ${#langs[@]} - 1 )) \
+    -pair_filenames "${pair_files[@]}" -align-opt $align -output out.multivec -size $size -cbow 0 -iter $iter \
+    -threads $t -min-count 1 -debug 1 > multivec.t$t.log 2>&1
+  report multivec $t $multi_words
+
+  rm -f *.vocab.min*
+  align_args=()
+  [ "$align" -gt 0 ] && align_args=(-align "${pair_files[2]}" -align-opt $align)
+  "$bin/bivec" -src-train "${pair_files[0]}" -tgt-train "${pair_files[1]}" -src-lang $pivot -tgt-lang ${langs[1]} \
+    "${align_args[@]}" -output out.bivec -size $size -cbow 0 -iter $iter -threads $t -min-count 1 -debug 1 \
+    > bivec.t$t.log 2>&1
+  report bivec $t $bi_words
+done
@@ -0,0 +1,186 @@
+// Generates Zipf-distributed synthetic parallel corpora for benchmarking multivec and bivec.
+// The first language is paired with each of the others; for a pair of languages xx and yy it writes
+// <output>/xxyy.xx, <output>/xxyy.yy and, unless -align 0, the alignment file <output>/xxyy.align.
+// Word r of language xx is "xx<r>" (rank r, 1-based) and translates to "yy<r>"; target sentences
+// are noisy translations of the source ones: a word is replaced by a fresh draw with probability
+// -noise and neighbouring words swap places with probability -swap. Every translated word is linked
+// in the alignment file.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#define MAX_STRING 100
+#define MAX_SENTENCE_LENGTH 1000
+
+char output_dir[MAX_STRING] = ".";
+char **language_names;
+int num_languages = 2, write_align = 1;
+long long num_sentences = 100000, vocab_size = 50000, sentence_length = 20;
+double zipf_exponent = 1.0, noise = 0.1, swap = 0.1, unk_rate = 0.01;
+unsigned long long next_random = 1;
+double *cdf;
+
+double Uniform() {
+  next_random = next_random * (unsigned long long)25214903917 + 11;
+  return (next_random >> 16 & 0xFFFFFFFFFFFFULL) / (double)0x1000000000000ULL;
+}
+
+// Cumulative distribution of p(r) ~ 1 / r^zipf_exponent over ranks 1..vocab_size
+void InitZipf() {
+  long long r;
+  double sum = 0;
+  cdf = (double *)malloc(vocab_size * sizeof(double));
+  for (r = 0; r < vocab_size; r++) {
+    sum += pow(r + 1, -zipf_exponent);
+    cdf[r] = sum;
+  }
+  for (r = 0; r < vocab_size; r++) cdf[r] /= sum;
+}
+
+// Draws a rank; 0 stands for <unk>
+long long ZipfRank() {
+  long long lo = 0, hi = vocab_size - 1, mid;
+  double u;
+  if (Uniform() < unk_rate) return 0;
+  u = Uniform();
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (cdf[mid] < u) lo = mid + 1; else hi = mid;
+  }
+  return lo + 1;
+}
+
+void WriteWord(FILE *fo, char *lang, long long rank) {
+  if (rank == 0) fputs("<unk>", fo);
+  else fprintf(fo, "%s%lld", lang, rank);
+}
+
+FILE *OpenOutput(char *src, char *tgt, char *ext) {
+  char file_name[MAX_STRING * 4];
+  FILE *fo;
+  sprintf(file_name, "%s/%s%s.%s", output_dir, src, tgt, ext);
+  fo = fopen(file_name, "wb");
+  if (fo == NULL) {
+    printf("ERROR: cannot write %s\n", file_name);
+    exit(1);
+  }
+  printf("Writing %s\n", file_name);
+  return fo;
+}
+
+void GeneratePair(char *src, char *tgt) {
+  FILE *fs = OpenOutput(src, tgt, src), *ft = OpenOutput(src, tgt, tgt), *fa = NULL;
+  long long src_sen[MAX_SENTENCE_LENGTH], tgt_sen[MAX_SENTENCE_LENGTH], order[MAX_SENTENCE_LENGTH];
+  long long s, i, length, tmp, words = 0;
+  if (write_align) fa = OpenOutput(src, tgt, "align");
+  for (s = 0; s < num_sentences; s++) {
+    // uniform in [1, 2 * sentence_length - 1], so the mean is sentence_length
+    length = 1 + (long long)(Uniform() * (2 * sentence_length - 1));
+    if (length > MAX_SENTENCE_LENGTH) length = MAX_SENTENCE_LENGTH;
+    for (i = 0; i < length; i++) {
+      src_sen[i] = ZipfRank();
+      order[i] = i;
+    }
+    if (s == 0) src_sen[0] = 0; // both vocabs need <unk>
+    for (i = 0; i + 1 < length; i++) if (Uniform() < swap) {
+      tmp = order[i]; order[i] = order[i + 1]; order[i + 1] = tmp;
+      i++;
+    }
+    // target position i holds the translation of source position order[i]
+    for (i = 0; i < length; i++) tgt_sen[i] = Uniform() < noise ? -1 : src_sen[order[i]];
+    for (i = 0; i < length; i++) {
+      if (i > 0) { fputc(' ', fs); fputc(' ', ft); }
+      WriteWord(fs, src, src_sen[i]);
+      WriteWord(ft, tgt, tgt_sen[i] < 0 ? ZipfRank() : tgt_sen[i]);
+    }
+    fputc('\n', fs);
+    fputc('\n', ft);
+    if (fa != NULL) {
+      for (i = 0, tmp = 0; i < length; i++) if (tgt_sen[i] >= 0) {
+        fprintf(fa, tmp++ ? " %lld %lld" : "%lld %lld", order[i], i);
+      }
+      fputc('\n', fa);
+    }
+    words += length;
+  }
+  printf("%s-%s: %lld sentences, %lld words per side\n", src, tgt, num_sentences, words);
+  fclose(fs);
+  fclose(ft);
+  if (fa != NULL) fclose(fa);
+}
+
+int ArgPos(char *str, int argc, char **argv) {
+  int a;
+  for (a = 1; a < argc; a++) if (!strcmp(str, argv[a])) {
+    if (a == argc - 1) {
+      printf("Argument missing for %s\n", str);
+      exit(1);
+    }
+    return a;
+  }
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  int i, l;
+  if (argc == 1) {
+    printf("Synthetic parallel corpus generator\n\n");
+    printf("Options:\n");
+    printf("\t-output <dir>\n");
+    printf("\t\tWrite the corpus files to <dir>, created if missing; default is the current directory\n");
+    printf("\t-num_languages <int>\n");
+    printf("\t\tNumber of languages; the first one is paired with each of the others; default is 2\n");
+    printf("\t-language_names <names>\n");
+    printf("\t\tNames of the -num_languages languages; default is l0 l1 ...\n");
+    printf("\t-sentences <int>\n");
+    printf("\t\tSentences per language pair; default is 100000\n");
+    printf("\t-vocab <int>\n");
+    printf("\t\tVocabulary size of every language; default is 50000\n");
+    printf("\t-length <int>\n");
+    printf("\t\tMean sentence length; lengths are uniform in [1, 2 * <int> - 1]; default is 20\n");
+    printf("\t-zipf <float>\n");
+    printf("\t\tExponent of the Zipf distribution of word ranks; default is 1.0\n");
+    printf("\t-unk <float>\n");
+    printf("\t\tFraction of <unk> tokens; default is 0.01\n");
+    printf("\t-noise <float>\n");
+    printf("\t\tProbability that a target word is not the translation of a source word; default is 0.1\n");
+    printf("\t-swap <float>\n");
+    printf("\t\tProbability that two neighbouring target words are swapped; default is 0.1\n");
+    printf("\t-align <int>\n");
+    printf("\t\tWrite alignment files; default is 1\n");
+    printf("\t-seed <int>\n");
+    printf("\t\tRandom seed; default is 1\n");
+    printf("\nExamples:\n");
+    printf("./synthetic-corpus -output synth -num_languages 3 -language_names en de fr -sentences 1000000\n\n");
+    return 0;
+  }
+  if ((i = ArgPos((char *)"-output", argc, argv)) > 0) strcpy(output_dir, argv[i + 1]);
+  if ((i = ArgPos((char *)"-num_languages", argc, argv)) > 0) num_languages = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-sentences", argc, argv)) > 0) num_sentences = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-vocab", argc, argv)) > 0) vocab_size = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-length", argc, argv)) > 0) sentence_length = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-zipf", argc, argv)) > 0) zipf_exponent = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-unk", argc, argv)) > 0) unk_rate = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-noise", argc, argv)) > 0) noise = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-swap", argc, argv)) > 0) swap = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-align", argc, argv)) > 0) write_align = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-seed", argc, argv)) > 0) next_random = atoll(argv[i + 1]);
+  if (num_languages < 2 || vocab_size < 1 || sentence_length < 1) {
+    printf("ERROR: need at least 2 languages, a vocab and sentences of at least one word\n");
+    exit(1);
+  }
+  language_names = (char **)malloc(num_languages * sizeof(char *));
+  i = ArgPos((char *)"-language_names", argc, argv);
+  for (l = 0; l < num_languages; l++) {
+    language_names[l] = (char *)malloc(MAX_STRING);
+    if (i > 0 && i + 1 + l < argc) strcpy(language_names[l], argv[i + 1 + l]);
+    else sprintf(language_names[l], "l%d", l);
+  }
+  mkdir(output_dir, 0755);
+  InitZipf();
+  for (l = 1; l < num_languages; l++) GeneratePair(language_names[0], language_names[l]);
+  return 0;
+}